@@ -0,0 +1,158 @@
+#include "ofMain.h"
+#include "ofApp.h"
+
+//  ofApp                               interactive editor
+//  ofApp --workers host:port,...       editor renders ('t') are split into tiles
+//                                      and farmed out to these render workers
+//  ofApp --processes <n>               renders fork n processes that share
+//                                      one framebuffer (not on windows)
+//  ofApp --worker <port>               headless render worker
+//  ofApp --render <file>               headless render of the scene to <file>
+//                                      (relative to the data folder)
+//                                      (.pfm is float output; .pfm and .png are
+//                                      streamed per tile, so any size fits in memory)
+//  ofApp --size <w>x<h>                render resolution (the view plane follows its aspect)
+//  ofApp --fov <degrees>               vertical field of view of the render camera
+//  ofApp --aperture <r>                lens radius for depth of field (0 = pinhole)
+//  ofApp --focus <distance>            distance from the camera that stays sharp
+//  ofApp --shutter <0-1>               share of the frame the shutter is open for
+//                                      (motion blur of moving objects, 0 = none)
+//  ofApp --sphere <x>,<y>,<z>,<r>[,<dx>,<dy>,<dz>]
+//                                      adds a sphere to the scene, moving by
+//                                      <dx>,<dy>,<dz> over a frame if given
+//  ofApp --samples <n>                 rays per pixel (at most, with --adaptive)
+//  ofApp --adaptive <error>            stop sampling pixels once their error
+//                                      estimate is below <error> (e.g. .005)
+//  ofApp --fovea <u>,<v>               spend samples around this point of the image
+//                                      (0-1 across and down), fewer elsewhere; the
+//                                      editor starts foveated there, not at the mouse
+//  ofApp --density-mask <image>        spend samples where the mask is bright
+//  ofApp --environment <image>         HDR equirectangular map that lights the
+//                                      scene and fills the background
+//  ofApp --ao <samples>                ambient light with occlusion, baked per
+//                                      object unless followed by --no-bake
+//  ofApp --no-bake                     cast occlusion rays at every shading point
+//  ofApp --irradiance <samples>        one bounce of indirect diffuse light through
+//                                      an irradiance cache, <samples> rays a record
+//  ofApp --preset <name>               draft, preview or final (resolution is a
+//                                      fraction of --size), applied in order
+//  ofApp --estimate                    print the estimated render time before
+//                                      a headless render
+//  ofApp --budget <ms>                 render the best image that fits in <ms>
+//                                      (progressive passes, local only)
+//  ofApp --no-cache                    always render, even if an identical render
+//                                      is in data/renderCache
+//
+//  e.g. two local workers:   ofApp --worker 9001 &  ofApp --worker 9002 &
+//                            ofApp --workers localhost:9001,localhost:9002
+//
+int main(int argc, char* argv[]) {
+	ofApp* app = new ofApp();
+	int workerPort = 0;
+	string renderFile;
+	bool estimate = false;
+
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--worker" && hasValue) workerPort = ofToInt(argv[++i]);
+		else if (arg == "--workers" && hasValue) app->renderWorkers = ofSplitString(argv[++i], ",", true, true);
+		else if (arg == "--render" && hasValue) renderFile = argv[++i];
+		else if (arg == "--processes" && hasValue) app->renderProcesses = ofToInt(argv[++i]);
+		else if (arg == "--size" && hasValue) {
+			vector<string> size = ofSplitString(argv[++i], "x");
+			if (size.size() != 2 || ofToInt(size[0]) <= 0 || ofToInt(size[1]) <= 0) {
+				cout << "--size expects <width>x<height>" << endl;
+				delete app;
+				return 1;
+			}
+			app->imageWidth = app->settings.width = ofToInt(size[0]);
+			app->imageHeight = app->settings.height = ofToInt(size[1]);
+		}
+		else if (arg == "--no-cache") app->useCache = false;
+		else if (arg == "--sphere" && hasValue) {
+			vector<string> v = ofSplitString(argv[++i], ",");
+			if ((v.size() != 4 && v.size() != 7) || ofToFloat(v[3]) <= 0) {
+				cout << "--sphere expects <x>,<y>,<z>,<radius>[,<dx>,<dy>,<dz>]" << endl;
+				delete app;
+				return 1;
+			}
+			ofApp::ExtraSphere sphere{ glm::vec3(ofToFloat(v[0]), ofToFloat(v[1]), ofToFloat(v[2])), ofToFloat(v[3]), glm::vec3(0) };
+			if (v.size() == 7) sphere.motion = glm::vec3(ofToFloat(v[4]), ofToFloat(v[5]), ofToFloat(v[6]));
+			app->extraSpheres.push_back(sphere);
+		}
+		else if (arg == "--preset" && hasValue) {
+			if (!app->applyPreset(argv[++i])) {
+				cout << "unknown preset " << argv[i] << endl;
+				delete app;
+				return 1;
+			}
+		}
+		else if (arg == "--estimate") estimate = true;
+		else if (arg == "--adaptive" && hasValue) app->settings.adaptiveThreshold = std::max(0.0f, ofToFloat(argv[++i]));
+		else if (arg == "--fovea" && hasValue) {
+			vector<string> focus = ofSplitString(argv[++i], ",");
+			if (focus.size() != 2) {
+				cout << "--fovea expects <u>,<v>" << endl;
+				delete app;
+				return 1;
+			}
+			app->foveate = true;
+			app->foveaFocus = glm::vec2(ofToFloat(focus[0]), ofToFloat(focus[1]));
+			app->foveaOnMouse = false;
+		}
+		else if (arg == "--density-mask" && hasValue) {
+			app->densityMask = argv[++i];
+			app->foveate = false;
+			if (!app->density.loadMask(app->densityMask)) {
+				delete app;
+				return 1;
+			}
+		}
+		else if (arg == "--environment" && hasValue) {
+			if (!app->environment.load(argv[++i])) {
+				delete app;
+				return 1;
+			}
+		}
+		else if (arg == "--ao" && hasValue) app->settings.aoSamples = std::max(0, ofToInt(argv[++i]));
+		else if (arg == "--no-bake") app->settings.aoBake = false;
+		else if (arg == "--irradiance" && hasValue) app->settings.irradianceSamples = std::max(0, ofToInt(argv[++i]));
+		else if (arg == "--aperture" && hasValue) app->renderCam.aperture = std::max(0.0f, ofToFloat(argv[++i]));
+		else if (arg == "--focus" && hasValue) app->renderCam.focusDistance = std::max(.01f, ofToFloat(argv[++i]));
+		else if (arg == "--shutter" && hasValue) app->settings.shutter = glm::clamp(ofToFloat(argv[++i]), 0.0f, 1.0f);
+		else if (arg == "--samples" && hasValue) app->settings.samples = std::max(1, ofToInt(argv[++i]));
+		else if (arg == "--budget" && hasValue) app->renderBudget = std::max(0, ofToInt(argv[++i]));
+		else if (arg == "--fov" && hasValue) app->settings.fov = glm::clamp(ofToFloat(argv[++i]), 1.0f, 170.0f);
+		else {
+			cout << "unknown argument " << arg << endl;
+			delete app;
+			return 1;
+		}
+	}
+
+	if (workerPort > 0) {
+		int result = app->runWorker(workerPort);
+		delete app;
+		return result;
+	}
+
+	if (!renderFile.empty()) {
+		app->setupScene();
+		if (estimate) {
+			app->buildPrims();
+			app->printEstimate();
+		}
+		bool saved = app->renderToFile(renderFile);
+		delete app;
+		return saved ? 0 : 1;
+	}
+
+	//the instanced preview needs GL 3.3 shaders
+	ofGLWindowSettings window;
+	window.setGLVersion(3, 3);
+	window.setSize(1024, 768);
+	window.windowMode = OF_WINDOW;
+	ofCreateWindow(window);
+	ofRunApp(app);
+}
@@ -2,6 +2,26 @@
 
 #include <glm/gtx/intersect.hpp>
 
+#include <condition_variable>
+#include <filesystem>
+#include <iomanip>
+
+#ifdef TARGET_WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
+
 
 //make manipulator more smooth
 
@@ -9,6 +29,60 @@
 
 
 
+// Bump allocate size bytes from the current block, moving on to the next
+// (or a new) block when it does not fit
+//
+void* Arena::allocate(size_t size, size_t align) {
+	while (current < blocks.size()) {
+		Block& b = blocks[current];
+		uintptr_t base = (uintptr_t)b.data;
+		size_t offset = ((base + b.used + align - 1) & ~(uintptr_t)(align - 1)) - base;
+		if (offset + size <= b.size) {
+			b.used = offset + size;
+			return b.data + offset;
+		}
+		if (current + 1 == blocks.size()) break;
+		current++;
+	}
+
+	size_t size1 = glm::max(blockSize, size + align);
+	blocks.push_back(Block{ (char*) ::operator new(size1), size1, 0 });
+	current = blocks.size() - 1;
+	return allocate(size, align);
+}
+
+Arena::Marker Arena::mark() const {
+	Marker m;
+	m.block = current;
+	m.used = blocks.empty() ? 0 : blocks[current].used;
+	m.dtorCount = dtors.size();
+	return m;
+}
+
+// Destroy everything created after the marker and make its memory reusable
+//
+void Arena::rewind(const Arena::Marker& m) {
+	while (dtors.size() > m.dtorCount) {
+		dtors.back().fn(dtors.back().obj);
+		dtors.pop_back();
+	}
+	for (size_t i = m.block; i < blocks.size(); i++) blocks[i].used = 0;
+	if (m.block < blocks.size()) blocks[m.block].used = m.used;
+	current = m.block;
+}
+
+size_t Arena::bytesUsed() const {
+	size_t total = 0;
+	for (size_t i = 0; i < blocks.size() && i <= current; i++) total += blocks[i].used;
+	return total;
+}
+
+Arena& scratchArena() {
+	thread_local Arena arena(256 * 1024);
+	return arena;
+}
+
+
 // Intersect Ray with Plane  (wrapper on glm::intersect*
 //
 
@@ -37,18 +111,36 @@ bool Plane::intersect(const Ray& ray, glm::vec3& point, glm::vec3& normalAtInter
 // Convert (u, v) to (x, y, z) 
 // We assume u,v is in [0, 1]
 //
-glm::vec3 ViewPlane::toWorld(float u, float v) {
+glm::vec3 ViewPlane::toWorld(float u, float v) const {
 	float w = width();
 	float h = height();
 	return (glm::vec3((u * w) + min.x, (v * h) + min.y, position.z));
 }
 
+// Size the ViewPlane for a vertical field of view (degrees) and aspect
+// ratio, keeping its distance from the camera
+//
+void RenderCam::setFov(float fov, float aspect) {
+	float distance = glm::abs(position.z - view.position.z);
+	float halfHeight = distance * tan(glm::radians(fov) / 2);
+	float halfWidth = halfHeight * aspect;
+	view.setSize(glm::vec2(-halfWidth, -halfHeight), glm::vec2(halfWidth, halfHeight));
+}
+
 // Get a ray from the current camera position to the (u, v) position on
-// the ViewPlane
+// the ViewPlane.  With an aperture the ray starts at lens (a point on the
+// unit disk, scaled by the aperture) and passes through the pinhole ray's
+// point on the focus plane, so only things at focusDistance stay sharp.
 //
-Ray RenderCam::getRay(float u, float v) {
+Ray RenderCam::getRay(float u, float v, const glm::vec2& lens) const {
 	glm::vec3 pointOnPlane = view.toWorld(u, v);
-	return(Ray(position, glm::normalize(pointOnPlane - position)));
+	glm::vec3 d = glm::normalize(pointOnPlane - position);
+	if (aperture <= 0) return(Ray(position, d));
+
+	//camera looks down -z
+	glm::vec3 focusPoint = position + d * (focusDistance / -d.z);
+	glm::vec3 origin = position + glm::vec3(lens * aperture, 0);
+	return(Ray(origin, glm::normalize(focusPoint - origin)));
 }
 
 
@@ -56,11 +148,38 @@ Ray RenderCam::getRay(float u, float v) {
 void ofApp::setup() {
 	image.allocate(imageWidth, imageHeight, ofImageType::OF_IMAGE_COLOR);
 
+	//sliders start from settings, so command line options (--size,
+	//--preset, ...) carry over into the first render
 	gui.setup();
-	gui.add(intensity.setup("Light intensity", .2, .05, 5));
-	gui.add(spotLightIntensity.setup("Spot light intensity", .2, .05, 5));
-
-	gui.add(power.setup("Phong p", 100, 10, 10000));
+	gui.add(intensity.setup("Light intensity", settings.intensity, 1, 5000));
+	gui.add(spotLightIntensity.setup("Spot light intensity", settings.spotLightIntensity, 1, 10000));
+	gui.add(lightRange.setup("Light range (0 = unlimited)", settings.lightRange, 0, 500));
+	gui.add(renderWidth.setup("Render width", settings.width, 16, 4096));
+	gui.add(renderHeight.setup("Render height", settings.height, 16, 4096));
+	gui.add(fov.setup("Field of view", settings.fov, 1, 120));
+	gui.add(aperture.setup("Aperture (0 = pinhole)", renderCam.aperture, 0, 2));
+	gui.add(focusDistance.setup("Focus distance", renderCam.focusDistance, 1, 100));
+	gui.add(shutter.setup("Shutter (0 = no motion blur)", settings.shutter, 0, 1));
+	gui.add(environmentIntensity.setup("Environment intensity", settings.environmentIntensity, 0, 10));
+	gui.add(environmentSamples.setup("Environment samples", settings.environmentSamples, 1, 256));
+	gui.add(aoSamples.setup("Ambient occlusion samples (0 = off)", settings.aoSamples, 0, 64));
+	gui.add(aoDistance.setup("Occlusion distance", settings.aoDistance, .5, 50));
+	gui.add(aoIntensity.setup("Ambient light", settings.aoIntensity, 0, 2));
+	gui.add(aoBake.setup("Bake occlusion", settings.aoBake));
+	gui.add(irradianceSamples.setup("Indirect light samples (0 = off)", settings.irradianceSamples, 0, 256));
+	gui.add(irradianceError.setup("Irradiance cache error", settings.irradianceError, .05, 1));
+
+	gui.add(power.setup("Phong p", settings.power, 10, 10000));
+	gui.add(shadows.setup("Shadows", settings.shadows));
+	gui.add(specular.setup("Specular", settings.specular));
+	gui.add(processes.setup("Render processes", renderProcesses, 1, 16));
+	gui.add(pixelSamples.setup("Samples per pixel", settings.samples, 1, 64));
+	gui.add(foveated.setup(foveaOnMouse ? "Foveated sampling (mouse)" : "Foveated sampling", foveate));
+	gui.add(foveaRadius.setup("Fovea radius", foveaSize, .05, 1));
+	gui.add(adaptiveThreshold.setup("Adaptive threshold (0 = off)", settings.adaptiveThreshold, 0, .05));
+	gui.add(timeBudget.setup("Time budget (ms, 0 = off)", renderBudget, 0, 10000));
+	gui.add(saveHdr.setup("Save HDR (output.pfm)", false));
+	gui.add(cacheRenders.setup("Use render cache", useCache));
 	bHide = true;
 
 	theCam = &mainCam;
@@ -86,281 +205,2384 @@ void ofApp::setup() {
 	cout << "t to start ray tracer" << endl;
 	cout << "d to show render" << endl;
 	cout << "arrow keys to change selected cone angle" << endl;
+	cout << "1/2/3 for draft/preview/final render settings" << endl;
+	cout << "e to estimate render time" << endl;
+
+	preview.setup();
+	setupScene();
+}
+
+//--------------------------------------------------------------
+//initial scene state (also used by headless renders, without a window)
+void ofApp::setupScene() {
+	loadScene();
+}
+
+//--------------------------------------------------------------
+//(re)builds all scene objects and lights in the scene arena
+//everything from the previous load is freed in one shot
+void ofApp::loadScene() {
+	scene.clear();
+	light.clear();
+	spotLights.clear();
+	sceneArena.reset();
+
+	scene.push_back(sceneArena.create<Plane>(glm::vec3(0, -5, 0), glm::vec3(0, 1, 0), ofColor::green, 600, 400));				//ground plane
+
+	scene.push_back(sceneArena.create<Plane>(glm::vec3(0, 0, -10), glm::vec3(0, 0, 1), ofColor::darkGrey, 600, 400));			//back wall
+
+	//scene.push_back(sceneArena.create<Sphere>(glm::vec3(0, 1, -2), 1, ofColor::purple));									//purple sphere
 
+	//scene.push_back(sceneArena.create<Sphere>(glm::vec3(-1, 0, 1), 1, ofColor::blue));										//blue sphere
 
+	//scene.push_back(sceneArena.create<Sphere>(glm::vec3(.5, 0, 0), 1, ofColor::darkGreen));									//green sphere
+
+	for (const ExtraSphere& s : extraSpheres) {
+		scene.push_back(sceneArena.create<Sphere>(s.center, s.radius, ofColor::purple));
+		scene.back()->motion = s.motion;
+	}
 
-	aimPoint.clear();
-	spotLightPos.clear();
-	angle.clear();
 
-	aimPoint.push_back(glm::vec3(1, -5, 0));
-	spotLightPos.push_back(glm::vec3(-20, 30, 45));
-	angle.push_back(15);
+	//light.push_back(sceneArena.create<Light>(glm::vec3(100, 150, 150), .2));			//top right light
 
+	//light.push_back(sceneArena.create<Light>(glm::vec3(-20, 30, 45), .2));		//top left light
 
-	//aimPoint.push_back(glm::vec3(3, 3, 0));
-	spotLightPos.push_back(glm::vec3(-50, 30, 45));
-	angle.push_back(15);
+	spotLights.push_back(sceneArena.create<spotLight>(glm::vec3(-20, 30, 45), glm::vec3(1, -5, 0), 2, 15));
 
+	//spotLights.push_back(sceneArena.create<spotLight>(glm::vec3(-50, 30, 45), glm::vec3(3, 3, 0), 2, 15));
+
+	lightIndex = 0;
+	updateScene();
+}
 
+//--------------------------------------------------------------
+//refreshes the editor's copies (picking, preview) after objects or
+//lights were edited in place
+void ofApp::updateScene() {
+	editPrims.clear();
+	for (int i = 0; i < scene.size(); i++) {
+		scene[i]->addPrims(editPrims, i);
+		editPrims.diffuse.push_back(toVec(scene[i]->diffuseColor));
+	}
+	buildPickPrims();
+	previewDirty = true;
 
+	sceneDirty = false;
 }
 
+//widens or narrows the selected spot light's cone
 void ofApp::updateAngle(bool increase) {
+	if (mainCam.getMouseInputEnabled() || lightIndex >= spotLights.size()) return;
+
+	spotLight* spot = spotLights[lightIndex];
 	if (increase) {
-		if (!mainCam.getMouseInputEnabled()) {
-			for (int i = 0; i < spotLights.size(); i++) {
-				if (angle[i] < 50) angle[i] += .5;
-			}
+		if (spot->getAngle() < 50) spot->setAngle(spot->getAngle() + .5);
+	}
+	else {
+		if (spot->getAngle() > 10) spot->setAngle(spot->getAngle() - .5);
+	}
+	sceneDirty = true;
+}
+
+//--------------------------------------------------------------
+void ofApp::update() {
+	//preview camera sees what the render camera sees
+	previewCam.setFov(fov);
+}
+
+//--------------------------------------------------------------
+void ofApp::rayTrace() {
+
+	cout << "drawing..." << endl;
+
+	captureSettings();
+	buildPrims();
+	updateView();
+	updateDensity();
+
+	string pngPath = ofToDataPath("output.png", true);
+	string pfmPath = ofToDataPath("output.pfm", true);
+	bool streamed = (size_t)settings.width * settings.height > maxStagedPixels;
+
+	//nothing changed since a previous render - reuse it
+	string snapshot = saveSnapshot();
+	bool cached = useCache && renderBudget == 0;
+	if (cached && renderCache.has(snapshot, "png") && (!saveHdr || renderCache.has(snapshot, "pfm"))) {
+		renderCache.fetch(snapshot, "png", pngPath);
+		if (saveHdr) renderCache.fetch(snapshot, "pfm", pfmPath);
+		if (!streamed) image.load(pngPath);
+		cout << "scene unchanged, render loaded from cache" << endl;
+		return;
+	}
+
+	//8 bit preview (and png), plus float output streamed as tiles finish.
+	//images too big to hold in memory stream their png too, and only a
+	//window sized preview is kept
+	ofPixels pixels;
+	PixelsSink preview(pixels, streamed ? ofGetWidth() : 0, streamed ? ofGetHeight() : 0);
+	PngWriter png(pngPath);
+	PfmWriter hdr(pfmPath);
+	TeeSink sinks({ &preview, streamed ? &png : nullptr, saveHdr ? &hdr : nullptr });
+	if (!render(sinks)) {
+		cout << "render failed" << endl;
+		return;
+	}
+	image.setFromPixels(pixels);
+	if (!streamed) image.save(pngPath);
+
+	if (cached) {
+		renderCache.store(snapshot, "png", pngPath);
+		if (saveHdr) renderCache.store(snapshot, "pfm", pfmPath);
+	}
+
+	cout << "render saved" << endl;
+}
+
+//--------------------------------------------------------------
+//64 bit FNV-1a of the snapshot, as hex
+string RenderCache::hash(const string& snapshot) {
+	uint64_t h = 14695981039346656037ull;
+	for (unsigned char c : snapshot) {
+		h ^= c;
+		h *= 1099511628211ull;
+	}
+	char hex[17];
+	snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)h);
+	return hex;
+}
+
+static bool readFile(const string& path, string& contents) {
+	ifstream in(path, ios::binary);
+	if (!in) return false;
+	contents.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+	return true;
+}
+
+string RenderCache::entry(const string& snapshot, const string& ext) const {
+	return ofToDataPath(dir + "/" + hash(snapshot) + "." + ext, true);
+}
+
+//--------------------------------------------------------------
+//an entry only counts if it was rendered from exactly this snapshot
+bool RenderCache::has(const string& snapshot, const string& ext) const {
+	string stored;
+	return ofFile::doesFileExist(entry(snapshot, ext), false) && readFile(entry(snapshot, "scene"), stored) && stored == snapshot;
+}
+
+//a fetched entry is touched, so its write time is its last use
+bool RenderCache::fetch(const string& snapshot, const string& ext, const string& destination) const {
+	if (!has(snapshot, ext) || !ofFile::copyFromTo(entry(snapshot, ext), destination, false, true)) return false;
+	error_code error;
+	filesystem::last_write_time(entry(snapshot, ext), filesystem::file_time_type::clock::now(), error);
+	filesystem::last_write_time(entry(snapshot, "scene"), filesystem::file_time_type::clock::now(), error);
+	return true;
+}
+
+void RenderCache::store(const string& snapshot, const string& ext, const string& source) const {
+	error_code error;
+	if (filesystem::file_size(ofToDataPath(source, true), error) > maxBytes && !error) {
+		cout << "render too large for cache " << dir << endl;
+		return;
+	}
+	ofDirectory::createDirectory(ofToDataPath(dir, true), false, true);
+	ofstream out(entry(snapshot, "scene"), ios::binary | ios::trunc);
+	out << snapshot;
+	out.close();
+	if (!out || !ofFile::copyFromTo(source, entry(snapshot, ext), false, true)) {
+		cout << "could not add render to cache " << dir << endl;
+	}
+	prune(hash(snapshot));
+}
+
+//--------------------------------------------------------------
+//removes whole entries (every file of a hash), least recently used
+//first, until the cache is under maxBytes.  keep is the entry just
+//stored.
+void RenderCache::prune(const string& keep) const {
+	struct Entry {
+		uint64_t bytes = 0;
+		filesystem::file_time_type used = filesystem::file_time_type::min();
+		vector<filesystem::path> files;
+	};
+	map<string, Entry> entries;
+	uint64_t total = 0;
+	error_code error;
+	for (const filesystem::directory_entry& file : filesystem::directory_iterator(ofToDataPath(dir, true), error)) {
+		if (!file.is_regular_file(error)) continue;
+		Entry& e = entries[file.path().stem().string()];
+		uint64_t bytes = file.file_size(error);
+		e.bytes += bytes;
+		e.used = std::max(e.used, file.last_write_time(error));
+		e.files.push_back(file.path());
+		total += bytes;
+	}
+	if (total <= maxBytes) return;
+
+	vector<pair<filesystem::file_time_type, string>> oldest;
+	for (const auto& e : entries) if (e.first != keep) oldest.push_back({ e.second.used, e.first });
+	sort(oldest.begin(), oldest.end());
+	int removed = 0;
+	for (const auto& old : oldest) {
+		if (total <= maxBytes) break;
+		const Entry& e = entries[old.second];
+		for (const filesystem::path& file : e.files) filesystem::remove(file, error);
+		total -= e.bytes;
+		removed++;
+	}
+	cout << "render cache: removed " << removed << " old entries" << endl;
+}
+
+//--------------------------------------------------------------
+//quantizes rendered tiles into the output pixels, keeping every
+//scale'th pixel when the image is bigger than maxWidth x maxHeight
+bool PixelsSink::begin(int width, int height) {
+	scale = 1;
+	if (maxWidth > 0 && maxHeight > 0) {
+		scale = glm::max(1, (int)ceil(glm::max((float)width / maxWidth, (float)height / maxHeight)));
+	}
+	pixels.allocate((width + scale - 1) / scale, (height + scale - 1) / scale, OF_IMAGE_COLOR);
+	return true;
+}
+
+void PixelsSink::writeTile(const RenderTile& tile, const float* rgb) {
+	for (int y = 0; y < tile.h; y++) {
+		if ((tile.y + y) % scale) continue;
+		for (int x = 0; x < tile.w; x++) {
+			if ((tile.x + x) % scale) continue;
+			const float* c = rgb + (y * tile.w + x) * 3;
+			pixels.setColor((tile.x + x) / scale, (tile.y + y) / scale, toColor(glm::vec3(c[0], c[1], c[2])));
+		}
+	}
+}
+
+//--------------------------------------------------------------
+//PNG written a band of tiles at a time.  The zlib stream uses stored
+//(uncompressed) deflate blocks, so no compression library is needed and
+//every band can go to disk the moment its last tile arrives.
+static uint32_t crc32(uint32_t crc, const unsigned char* data, size_t size) {
+	static uint32_t table[256];
+	static bool ready = false;
+	if (!ready) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		ready = true;
+	}
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void putBigEndian(vector<unsigned char>& out, uint32_t v) {
+	out.push_back(v >> 24);
+	out.push_back(v >> 16);
+	out.push_back(v >> 8);
+	out.push_back(v);
+}
+
+void PngWriter::writeChunk(const char* type, const vector<unsigned char>& data) {
+	vector<unsigned char> chunk;
+	putBigEndian(chunk, data.size());
+	chunk.insert(chunk.end(), type, type + 4);
+	chunk.insert(chunk.end(), data.begin(), data.end());
+	putBigEndian(chunk, crc32(0, &chunk[4], chunk.size() - 4));
+	file.write((const char*)chunk.data(), chunk.size());
+}
+
+bool PngWriter::begin(int width, int height) {
+	this->width = width;
+	this->height = height;
+	nextRow = 0;
+	adlerA = 1;
+	adlerB = 0;
+	bands.clear();
+	file.open(path, ios::out | ios::binary | ios::trunc);
+
+	const unsigned char signature[] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	file.write((const char*)signature, sizeof(signature));
+
+	vector<unsigned char> ihdr;
+	putBigEndian(ihdr, width);
+	putBigEndian(ihdr, height);
+	ihdr.insert(ihdr.end(), { 8, 2, 0, 0, 0 });      // 8 bit RGB, no interlace
+	writeChunk("IHDR", ihdr);
+	writeChunk("IDAT", { 0x78, 0x01 });                // zlib header
+
+	ok = file.good();
+	if (!ok) cout << "could not write " << path << endl;
+	return ok;
+}
+
+void PngWriter::writeTile(const RenderTile& tile, const float* rgb) {
+	lock_guard<mutex> guard(lock);
+	if (!ok) return;
+
+	//scanlines of the band this tile belongs to, each with a filter byte
+	size_t stride = 1 + width * 3;
+	Band& band = bands[tile.y];
+	if (band.data.empty()) {
+		band.rows = tile.h;
+		band.data.assign(stride * tile.h, 0);
+	}
+	for (int y = 0; y < tile.h; y++) {
+		unsigned char* row = &band.data[y * stride + 1 + tile.x * 3];
+		for (int x = 0; x < tile.w * 3; x++) {
+			row[x] = (unsigned char)(glm::clamp(rgb[y * tile.w * 3 + x], 0.0f, 1.0f) * 255.0f);
+		}
+	}
+	band.pixels += tile.w * tile.h;
+
+	//flush complete bands in order
+	while (!bands.empty() && bands.begin()->first == nextRow && bands.begin()->second.pixels == (size_t)width * bands.begin()->second.rows) {
+		Band& b = bands.begin()->second;
+		for (unsigned char c : b.data) {
+			adlerA = (adlerA + c) % 65521;
+			adlerB = (adlerB + adlerA) % 65521;
+		}
+		nextRow += b.rows;
+
+		vector<unsigned char> idat;
+		for (size_t offset = 0; offset < b.data.size(); offset += 65535) {
+			size_t size = std::min(b.data.size() - offset, (size_t)65535);
+			bool last = nextRow == height && offset + size == b.data.size();
+			idat.push_back(last ? 1 : 0);
+			idat.push_back(size & 0xff);
+			idat.push_back(size >> 8);
+			idat.push_back(~size & 0xff);
+			idat.push_back((~size >> 8) & 0xff);
+			idat.insert(idat.end(), b.data.begin() + offset, b.data.begin() + offset + size);
+		}
+		writeChunk("IDAT", idat);
+		bands.erase(bands.begin());
+	}
+	ok = file.good();
+}
+
+bool PngWriter::end() {
+	if (ok && nextRow == height) {
+		vector<unsigned char> adler;
+		putBigEndian(adler, (adlerB << 16) | adlerA);
+		writeChunk("IDAT", adler);
+		writeChunk("IEND", {});
+	}
+	else ok = false;
+	file.close();
+	if (ok) cout << "saved " << path << endl;
+	return ok;
+}
+
+//--------------------------------------------------------------
+//PFM: text header, then little endian float RGB rows, bottom row first
+bool PfmWriter::begin(int width, int height) {
+	this->width = width;
+	this->height = height;
+	file.open(path, ios::in | ios::out | ios::binary | ios::trunc);
+	file << "PF\n" << width << " " << height << "\n-1.0\n";
+	dataStart = file.tellp();
+
+	//size the file now so tiles can land anywhere in it
+	streamoff size = dataStart + (streamoff)width * height * 3 * sizeof(float);
+	file.seekp(size - 1);
+	file.put(0);
+	ok = file.good();
+	if (!ok) cout << "could not write " << path << endl;
+	return ok;
+}
+
+void PfmWriter::writeTile(const RenderTile& tile, const float* rgb) {
+	lock_guard<mutex> guard(lock);
+	if (!ok) return;
+	for (int y = 0; y < tile.h; y++) {
+		streamoff row = height - 1 - (tile.y + y);
+		file.seekp(dataStart + (row * width + tile.x) * 3 * (streamoff)sizeof(float));
+		file.write((const char*)(rgb + y * tile.w * 3), tile.w * 3 * sizeof(float));
+	}
+	ok = file.good();
+}
+
+bool PfmWriter::end() {
+	file.close();
+	if (ok) cout << "saved " << path << endl;
+	return ok;
+}
+
+//--------------------------------------------------------------
+//splits the image into tiles, row by row
+vector<RenderTile> makeTiles(int width, int height, int tileSize) {
+	vector<RenderTile> tiles;
+	for (int y = 0; y < height; y += tileSize) {
+		for (int x = 0; x < width; x += tileSize) {
+			tiles.push_back(RenderTile{ x, y, std::min(tileSize, width - x), std::min(tileSize, height - y) });
 		}
 	}
+	return tiles;
+}
+
+//--------------------------------------------------------------
+//job(0) .. job(count - 1) shared out to one thread per core, in no
+//particular order
+template<class Job>
+static void parallelFor(size_t count, const Job& job) {
+	atomic<size_t> next(0);
+	auto work = [&]() {
+		for (size_t i = next++; i < count; i = next++) job(i);
+	};
+	vector<thread> threads;
+	for (unsigned i = 1; i < std::max(1u, thread::hardware_concurrency()); i++) threads.push_back(thread(work));
+	work();
+	for (thread& t : threads) t.join();
+}
+
+//--------------------------------------------------------------
+//renders the flattened scene (buildPrims() or loadSnapshot() first),
+//handing each tile to the sink as soon as it is done
+bool ofApp::render(TileSink& sink) {
+	uint64_t deadline = ofGetElapsedTimeMicros() + (uint64_t)renderBudget * 1000;
+	bool budgeted = renderBudget > 0;
+	if (budgeted && !renderWorkers.empty()) {
+		cout << "time budget ignored: distributed renders are not budgeted" << endl;
+		budgeted = false;
+	}
+	else if (budgeted && (size_t)settings.width * settings.height > maxStagedPixels) {
+		cout << "time budget ignored: " << settings.width << "x" << settings.height << " is more than can be staged in memory" << endl;
+		budgeted = false;
+	}
+
+	updateView();
+	bakeOcclusion();
+	cacheIrradiance();
+	shadeFn = selectShade();
+	if (!sink.begin(settings.width, settings.height)) return false;
+
+	vector<RenderTile> tiles = makeTiles(settings.width, settings.height, settings.tileSize);
+	if (!renderWorkers.empty()) renderDistributed(tiles, sink);
+	else if (budgeted) renderBudgeted(tiles, sink, deadline);
+	else if (renderProcesses > 1) renderForked(tiles, sink);
+	else renderTiles(tiles, sink);
+
+	return sink.end();
+}
+
+//--------------------------------------------------------------
+//derives the view plane from the output size and field of view
+void ofApp::updateView() {
+	renderCam.setFov(settings.fov, (float)settings.width / settings.height);
+}
+
+//--------------------------------------------------------------
+//builds the sample density for the output size (the fovea is round in
+//the image, so it depends on the aspect)
+void ofApp::updateDensity() {
+	if (foveate) density.setFovea(foveaFocus, foveaSize, (float)settings.width / settings.height);
+	else if (!densityMask.empty()) density.loadMask(densityMask);
+	else density.clear();
+}
+
+//--------------------------------------------------------------
+//renders tiles one after the other in this process
+void ofApp::renderTiles(const vector<RenderTile>& tiles, TileSink& sink) const {
+	//one tile of float pixels at a time in per-thread scratch memory
+	ArenaScope scratch(scratchArena());
+	float* rgb = scratch.arena.allocArray<float>(settings.tileSize * settings.tileSize * 3);
+
+	for (const RenderTile& tile : tiles) {
+		renderTile(tile, rgb);
+		sink.writeTile(tile, rgb);
+	}
+}
+
+//--------------------------------------------------------------
+//renders the scene from setupScene() without a window.  .pfm and .png
+//files are streamed tile by tile; other formats go through 8 bit pixels,
+//so they are only allowed up to maxStagedPixels
+bool ofApp::renderToFile(const string& path) {
+	buildPrims();
+	updateView();
+	updateDensity();
+
+	string file = ofToDataPath(path, true);
+	string ext = ofToLower(ofFilePath::getFileExt(path));
+
+	//batch renders of unchanged frames are just a copy
+	string snapshot = saveSnapshot();
+	bool cached = useCache && renderBudget == 0;
+	if (cached && renderCache.fetch(snapshot, ext, file)) {
+		cout << path << " unchanged, copied from render cache" << endl;
+		return true;
+	}
+
+	bool saved;
+	if (ext == "pfm") {
+		PfmWriter pfm(file);
+		saved = render(pfm);
+	}
+	else if (ext == "png") {
+		PngWriter png(file);
+		saved = render(png);
+	}
+	else if ((size_t)settings.width * settings.height > maxStagedPixels) {
+		cout << "image too large for ." << ext << ", render to .png or .pfm" << endl;
+		return false;
+	}
 	else {
-		if (!mainCam.getMouseInputEnabled()) {
-			for (int i = 0; i < spotLights.size(); i++) {
-				if (angle[i] > 10) angle[i] -= .5;
+		ofPixels pixels;
+		PixelsSink sink(pixels);
+		saved = render(sink) && ofSaveImage(pixels, file);
+	}
+
+	if (saved && cached) renderCache.store(snapshot, ext, file);
+	return saved;
+}
+
+//--------------------------------------------------------------
+//traces every pixel of a tile into rgb (3 floats per pixel, tile rows),
+//averaging samples [firstSample, firstSample + samples) of each pixel.
+//Adaptive renders stop early on pixels whose error estimate is below
+//the threshold, so flat regions only get PixelStats::minSamples.  With a
+//sample density the count and threshold follow the pixel's weight.
+void ofApp::renderTile(const RenderTile& tile, float* rgb, int firstSample, int samples) const {
+	for (int y = 0; y < tile.h; y++) {
+		for (int x = 0; x < tile.w; x++) {
+			float weight = density.at((tile.x + x + .5f) / settings.width, (tile.y + y + .5f) / settings.height);
+			int count = SampleDensity::scale(samples, weight);
+			float threshold = settings.adaptiveThreshold / weight;
+
+			PixelStats pixel;
+			for (int i = firstSample; i < firstSample + count; i++) {
+				pixel.add(traceSample(tile.x + x, tile.y + y, i));
+				if (threshold > 0 && pixel.converged(threshold)) break;
 			}
+
+			float* out = rgb + (y * tile.w + x) * 3;
+			out[0] = pixel.mean.x;
+			out[1] = pixel.mean.y;
+			out[2] = pixel.mean.z;
 		}
 	}
 }
 
 //--------------------------------------------------------------
-void ofApp::update() {
+//color of one sample of pixel (x, y).  Each sample also gets its own
+//lens position and time, so depth of field and motion blur ride on the
+//pixel samples instead of multiplying them.
+glm::vec3 ofApp::traceSample(int x, int y, int sample) const {
+	glm::vec2 offset = samplePosition(sample);
+	float u = (x + offset.x) / settings.width;
+	float v = 1 - (y + offset.y) / settings.height;
+	Ray ray = renderCam.getRay(u, v, lensSample(sample, pixelShift(x, y, 0)));
+	ray.time = settings.shutter * sampleTime(sample, pixelShift(x, y, 1).x);
+	return traceRay(ray);
+}
 
+//--------------------------------------------------------------
+//one ray per block x block square of pixels, copied to the whole square
+void ofApp::renderTileCoarse(const RenderTile& tile, float* rgb, int block) const {
+	for (int by = 0; by < tile.h; by += block) {
+		for (int bx = 0; bx < tile.w; bx += block) {
+			int w = std::min(block, tile.w - bx), h = std::min(block, tile.h - by);
+			float u = (tile.x + bx + w * .5f) / settings.width;
+			float v = 1 - (tile.y + by + h * .5f) / settings.height;
+			Ray ray = renderCam.getRay(u, v);
+			ray.time = settings.shutter * sampleTime(0);
+			glm::vec3 color = traceRay(ray);
+
+			for (int y = by; y < by + h; y++) {
+				for (int x = bx; x < bx + w; x++) {
+					float* out = rgb + (y * tile.w + x) * 3;
+					out[0] = color.x;
+					out[1] = color.y;
+					out[2] = color.z;
+				}
+			}
+		}
+	}
 }
 
 //--------------------------------------------------------------
-void ofApp::rayTrace() {
+//progressive passes until the budget runs out: a coarse pass (one ray
+//per 4x4 block), one sample per pixel, 4 samples per pixel (AA), then
+//doubling the samples each pass.  Every pixel keeps running statistics
+//of its own samples, so running out mid pass still leaves each pixel at
+//its best result.  With an adaptive threshold, passes skip pixels that
+//have converged, and the render ends early once all of them have.  With
+//a sample density each pass gives a pixel its share of the pass's
+//samples (at least one).  A tile is only started if it should finish in
+//time, going by the slowest per-sample cost seen so far.  deadline is
+//in ofGetElapsedTimeMicros() time.
+void ofApp::renderBudgeted(const vector<RenderTile>& tiles, TileSink& sink, uint64_t deadline) const {
+	size_t tilePixels = settings.tileSize * settings.tileSize;
+
+	ArenaScope scratch(scratchArena());
+	float* image = scratch.arena.allocArray<float>(tiles.size() * tilePixels * 3);
+	PixelStats* stats = scratch.arena.allocArray<PixelStats>(tiles.size() * tilePixels);
+	std::fill_n(stats, tiles.size() * tilePixels, PixelStats());
+
+	//the coarse pass always runs, so every pixel has a color
+	for (size_t i = 0; i < tiles.size(); i++) renderTileCoarse(tiles[i], image + i * tilePixels * 3, 4);
+
+	//per pixel weight (1 without a density map) and threshold (0 = not adaptive)
+	float* weights = scratch.arena.allocArray<float>(tiles.size() * tilePixels);
+	for (size_t i = 0; i < tiles.size(); i++) {
+		for (int y = 0; y < tiles[i].h; y++) {
+			for (int x = 0; x < tiles[i].w; x++) {
+				weights[i * tilePixels + y * tiles[i].w + x] = density.at((tiles[i].x + x + .5f) / settings.width, (tiles[i].y + y + .5f) / settings.height);
+			}
+		}
+	}
+	auto needsSamples = [&](size_t k) {
+		return !(settings.adaptiveThreshold > 0 && stats[k].converged(settings.adaptiveThreshold / weights[k]));
+	};
+
+	double sampleCost = 0;                          // micros per pixel sample of the slowest tile
+	int samples = 0;
+	bool outOfTime = false, converged = false;
+	while (!outOfTime && !converged && samples < budgetMaxSamples) {
+		int passSamples = (samples == 0) ? 1 : (samples == 1) ? 3 : std::min(samples, budgetMaxSamples - samples);
+		converged = true;
+		for (size_t i = 0; i < tiles.size(); i++) {
+			const RenderTile& tile = tiles[i];
+			size_t work = 0;
+			for (int k = 0; k < tile.w * tile.h; k++) {
+				if (needsSamples(i * tilePixels + k)) work += SampleDensity::scale(passSamples, weights[i * tilePixels + k]);
+			}
+			if (work == 0) continue;
+			converged = false;
 
-	cout << "drawing..." << endl;
+			uint64_t start = ofGetElapsedTimeMicros();
+			if (start + sampleCost * work > deadline) {
+				outOfTime = true;
+				break;
+			}
+			for (int y = 0; y < tile.h; y++) {
+				for (int x = 0; x < tile.w; x++) {
+					size_t k = i * tilePixels + y * tile.w + x;
+					if (!needsSamples(k)) continue;
+					PixelStats& pixel = stats[k];
+					int count = SampleDensity::scale(passSamples, weights[k]);
+					for (int n = 0; n < count; n++) pixel.add(traceSample(tile.x + x, tile.y + y, pixel.n));
+
+					float* out = image + (i * tilePixels + y * tile.w + x) * 3;
+					out[0] = pixel.mean.x;
+					out[1] = pixel.mean.y;
+					out[2] = pixel.mean.z;
+				}
+			}
+			sampleCost = std::max(sampleCost, (double)(ofGetElapsedTimeMicros() - start) / work);
+		}
+		if (!outOfTime) samples += passSamples;
+	}
+
+	for (size_t i = 0; i < tiles.size(); i++) sink.writeTile(tiles[i], image + i * tilePixels * 3);
+
+	int fewest = INT_MAX, most = 0;
+	size_t total = 0, pixels = 0;
+	for (size_t i = 0; i < tiles.size(); i++) {
+		for (int k = 0; k < tiles[i].w * tiles[i].h; k++) {
+			int n = stats[i * tilePixels + k].n;
+			fewest = std::min(fewest, n);
+			most = std::max(most, n);
+			total += n;
+			pixels++;
+		}
+	}
+	cout << "time budget " << renderBudget << "ms: " << fewest << "-" << most << " samples per pixel, " << (float)total / pixels << " average"
+		<< (fewest == 0 ? " (0 = coarse)" : "") << (converged ? ", converged" : "") << endl;
+}
+
+//--------------------------------------------------------------
+//color seen along a primary ray
+glm::vec3 ofApp::traceRay(const Ray& r) const {
+	RayHit hit;
+	if (!prims.intersect(r, hit)) return environment.lookup(r.d) * settings.environmentIntensity;	//background
+
+	//add shading contribution
+	return (this->*shadeFn)(r.evalPoint(hit.t), hit.normal, prims.diffuse[hit.object], toVec(ofColor::lightGray), r.time, hit.object);
+}
+
+//--------------------------------------------------------------
+//flattens the scene and lights into per-type arrays for the tracer
+void ofApp::buildPrims() {
+	prims.clear();
+	for (int i = 0; i < scene.size(); i++) {
+		scene[i]->addPrims(prims, i);
+		prims.diffuse.push_back(toVec(scene[i]->diffuseColor));
+	}
+	for (int i = 0; i < light.size(); i++) {
+		light[i]->setIntensity(settings.intensity);
+		light[i]->setRange(settings.lightRange);
+		light[i]->addPrims(prims, i);
+	}
+	for (int i = 0; i < spotLights.size(); i++) {
+		spotLights[i]->setIntensity(settings.spotLightIntensity);
+		spotLights[i]->setRange(settings.lightRange);
+		spotLights[i]->addPrims(prims, i);
+	}
+	prims.buildAccel();
+}
+
+//--------------------------------------------------------------
+//selectable things as spheres: scene spheres in a bvh of their own,
+//and a handle on each spot light and its aim point kept apart so
+//they can win over objects in front of them
+void ofApp::buildPickPrims() {
+	pickPrims.clear();
+	handlePrims.clear();
+	pickHandles.clear();
+	for (const SpherePrim& s : editPrims.spheres) {
+		pickPrims.push_back(SpherePrim{ s.center, s.radius, (int)pickHandles.size() });
+		pickHandles.push_back(PickHandle{ PickHandle::Object, s.object });
+	}
+	for (int i = 0; i < spotLights.size(); i++) {
+		handlePrims.push_back(SpherePrim{ spotLights[i]->aimPoint, spotLights[i]->coneAngle, (int)pickHandles.size() });
+		pickHandles.push_back(PickHandle{ PickHandle::AimPoint, i });
+		handlePrims.push_back(SpherePrim{ spotLights[i]->position, spotLights[i]->coneHeight / 5, (int)pickHandles.size() });
+		pickHandles.push_back(PickHandle{ PickHandle::Light, i });
+	}
+	pickBvh.build(pickPrims);
+}
+
+//--------------------------------------------------------------
+//nearest selectable thing along a ray (normalized direction).  light
+//and aim handles take priority, so a sphere in front of one can't hide
+//it; only when no handle is hit does the nearest object count.
+PickHandle ofApp::pick(const Ray& ray) const {
+	RayHit hit;
+	intersectAll(handlePrims, ray, hit);
+	if (hit.object < 0) pickBvh.intersect(pickPrims, ray, hit);
+	if (hit.object < 0) return PickHandle();
+	return pickHandles[hit.object];
+}
+
+//--------------------------------------------------------------
+//closest hit over all primitive arrays
+bool ScenePrims::intersect(const Ray& ray, RayHit& hit) const {
+	sphereBvh.intersect(spheres, ray, hit);
+	intersectAll(planes, ray, hit);
+	return hit.object >= 0;
+}
+
+//--------------------------------------------------------------
+//any hit closer than maxT (shadow rays)
+bool ScenePrims::occluded(const Ray& ray, float maxT) const {
+	return sphereBvh.occluded(spheres, ray, maxT) || occludedAny(planes, ray, maxT);
+}
+
+
+//--------------------------------------------------------------
+//scene snapshots - plain text, written with enough precision to
+//round trip every float
+static void writeVec(ostream& out, const glm::vec3& v) {
+	out << " " << v.x << " " << v.y << " " << v.z;
+}
+
+static void readVec(istream& in, glm::vec3& v) {
+	in >> v.x >> v.y >> v.z;
+}
+
+static bool readSection(istream& in, const string& name, size_t& count) {
+	string tag;
+	in >> tag >> count;
+	return in && tag == name && count < 10000000;
+}
+
+void RenderSettings::write(ostream& out) const {
+	out << "settings " << width << " " << height << " " << tileSize << " " << power << " "
+		<< intensity << " " << spotLightIntensity << " " << lightRange << " " << shadows << " " << specular << " " << samples << " " << adaptiveThreshold << " " << shutter << " "
+		<< environmentIntensity << " " << environmentSamples << " " << aoSamples << " " << aoDistance << " " << aoIntensity << " " << aoBake << " "
+		<< irradianceSamples << " " << irradianceError << "\n";
+}
+
+bool RenderSettings::read(istream& in) {
+	string tag;
+	in >> tag >> width >> height >> tileSize >> power >> intensity >> spotLightIntensity >> lightRange >> shadows >> specular >> samples >> adaptiveThreshold >> shutter
+		>> environmentIntensity >> environmentSamples >> aoSamples >> aoDistance >> aoIntensity >> aoBake
+		>> irradianceSamples >> irradianceError;
+	return in && tag == "settings" && width > 0 && height > 0 && tileSize > 0 && samples > 0 && environmentSamples >= 0 && aoSamples >= 0 && aoDistance > 0
+		&& irradianceSamples >= 0 && irradianceError > 0;
+}
+
+void ScenePrims::write(ostream& out) const {
+	out << "spheres " << spheres.size() << "\n";
+	for (const SpherePrim& s : spheres) {
+		writeVec(out, s.center);
+		out << " " << s.radius << " " << s.object;
+		writeVec(out, s.motion);
+		out << "\n";
+	}
+	out << "planes " << planes.size() << "\n";
+	for (const PlanePrim& pl : planes) {
+		writeVec(out, pl.position);
+		writeVec(out, pl.normal);
+		out << " " << pl.width << " " << pl.height << " " << pl.object;
+		writeVec(out, pl.motion);
+		out << "\n";
+	}
+	out << "lights " << lights.size() << "\n";
+	for (const PointLightPrim& l : lights) {
+		writeVec(out, l.position);
+		out << " " << l.intensity;
+		writeVec(out, l.motion);
+		out << " " << l.invRange2 << "\n";
+	}
+	out << "spotlights " << spotLights.size() << "\n";
+	for (const SpotLightPrim& l : spotLights) {
+		writeVec(out, l.position);
+		writeVec(out, l.direction);
+		out << " " << l.intensity << " " << l.cosAngle;
+		writeVec(out, l.motion);
+		out << " " << l.invRange2 << "\n";
+	}
+	out << "diffuse " << diffuse.size() << "\n";
+	for (const glm::vec3& d : diffuse) {
+		writeVec(out, d);
+		out << "\n";
+	}
+}
+
+bool ScenePrims::read(istream& in) {
+	size_t count;
+	clear();
+	if (!readSection(in, "spheres", count)) return false;
+	spheres.resize(count);
+	for (SpherePrim& s : spheres) {
+		readVec(in, s.center);
+		in >> s.radius >> s.object;
+		readVec(in, s.motion);
+	}
+	if (!readSection(in, "planes", count)) return false;
+	planes.resize(count);
+	for (PlanePrim& pl : planes) {
+		readVec(in, pl.position);
+		readVec(in, pl.normal);
+		in >> pl.width >> pl.height >> pl.object;
+		readVec(in, pl.motion);
+	}
+	if (!readSection(in, "lights", count)) return false;
+	lights.resize(count);
+	for (PointLightPrim& l : lights) {
+		readVec(in, l.position);
+		in >> l.intensity;
+		readVec(in, l.motion);
+		in >> l.invRange2;
+	}
+	if (!readSection(in, "spotlights", count)) return false;
+	spotLights.resize(count);
+	for (SpotLightPrim& l : spotLights) {
+		readVec(in, l.position);
+		readVec(in, l.direction);
+		in >> l.intensity >> l.cosAngle;
+		readVec(in, l.motion);
+		in >> l.invRange2;
+	}
+	if (!readSection(in, "diffuse", count)) return false;
+	diffuse.resize(count);
+	for (glm::vec3& d : diffuse) readVec(in, d);
+	if (!in) return false;
+
+	//every object index has to have a material
+	for (const SpherePrim& s : spheres) if (s.object < 0 || s.object >= (int)count) return false;
+	for (const PlanePrim& pl : planes) if (pl.object < 0 || pl.object >= (int)count) return false;
+	buildAccel();
+	return true;
+}
+
+//--------------------------------------------------------------
+//everything needed to render the current scene: settings, camera and
+//the flattened primitives (buildPrims() first)
+string ofApp::saveSnapshot() const {
+	ostringstream out;
+	out << setprecision(9);
+	settings.write(out);
+	out << "camera";
+	writeVec(out, renderCam.position);
+	out << " " << renderCam.view.min.x << " " << renderCam.view.min.y << " " << renderCam.view.max.x << " " << renderCam.view.max.y << " " << renderCam.view.position.z
+		<< " " << renderCam.aperture << " " << renderCam.focusDistance << "\n";
+	density.write(out);
+	out << "environment " << quoted(environment.path) << " " << quoted(environment.hash) << "\n";
+	prims.write(out);
+	return out.str();
+}
+
+bool ofApp::loadSnapshot(const string& snapshot) {
+	istringstream in(snapshot);
+	string tag;
+	if (!settings.read(in)) return false;
+	in >> tag;
+	readVec(in, renderCam.position);
+	in >> renderCam.view.min.x >> renderCam.view.min.y >> renderCam.view.max.x >> renderCam.view.max.y >> renderCam.view.position.z
+		>> renderCam.aperture >> renderCam.focusDistance;
+	if (!in || tag != "camera" || renderCam.focusDistance <= 0) return false;
+	if (!density.read(in)) return false;
+
+	//the map itself isn't sent, a worker loads the same file from its data
+	//folder (again if the file changed) and it must have the same pixels
+	string path, hash;
+	in >> tag >> quoted(path) >> quoted(hash);
+	if (!in || tag != "environment") return false;
+	if (path.empty()) environment.clear();
+	else if ((path != environment.path || hash != environment.hash) && !environment.load(path)) return false;
+	if (environment.hash != hash) {
+		cout << "environment map " << path << " differs from the one in the snapshot" << endl;
+		return false;
+	}
+	return prims.read(in);
+}
+
+//--------------------------------------------------------------
+//blocking TCP sockets (winsock on windows, BSD sockets elsewhere)
+#ifdef TARGET_WIN32
+static bool initSockets() {
+	WSADATA data;
+	return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+}
+static void closeSocket(intptr_t fd) { closesocket(fd); }
+static void setBlocking(intptr_t fd, bool blocking) {
+	u_long nonBlocking = !blocking;
+	ioctlsocket(fd, FIONBIO, &nonBlocking);
+}
+static bool connectPending() { return WSAGetLastError() == WSAEWOULDBLOCK; }
+#else
+static bool initSockets() { return true; }
+static void closeSocket(intptr_t fd) { ::close(fd); }
+static void setBlocking(intptr_t fd, bool blocking) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+}
+static bool connectPending() { return errno == EINPROGRESS; }
+#endif
+
+//connects without blocking, so an unreachable host gives up after
+//timeoutMs instead of the system's much longer SYN timeout
+static bool connectWithin(intptr_t s, const sockaddr* addr, socklen_t length, int timeoutMs) {
+	setBlocking(s, false);
+	if (::connect(s, addr, length) != 0) {
+		if (!connectPending()) return false;
+		fd_set writable;
+		FD_ZERO(&writable);
+		FD_SET(s, &writable);
+		timeval timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+		if (select((int)s + 1, nullptr, &writable, nullptr, &timeout) != 1) return false;
+
+		int error = 0;
+		socklen_t size = sizeof(error);
+		if (getsockopt(s, SOL_SOCKET, SO_ERROR, (char*)&error, &size) != 0 || error != 0) return false;
+	}
+	setBlocking(s, true);
+	return true;
+}
+
+#ifdef MSG_NOSIGNAL
+static const int sendFlags = MSG_NOSIGNAL;             // a dead peer is an error, not SIGPIPE
+#else
+static const int sendFlags = 0;
+#endif
+
+bool TcpSocket::connect(const string& host, int port, int timeoutMs) {
+	static bool ready = initSockets();
+	close();
+
+	addrinfo hints = {};
+	addrinfo* result = nullptr;
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (!ready || getaddrinfo(host.c_str(), ofToString(port).c_str(), &hints, &result) != 0) return false;
+
+	for (addrinfo* a = result; a && fd == -1; a = a->ai_next) {
+		intptr_t s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (s == -1) continue;
+		if (connectWithin(s, a->ai_addr, (socklen_t)a->ai_addrlen, timeoutMs)) fd = s;
+		else closeSocket(s);
+	}
+	freeaddrinfo(result);
+
+	if (fd != -1) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+	}
+	return fd != -1;
+}
+
+bool TcpSocket::listen(int port) {
+	static bool ready = initSockets();
+	close();
+	if (!ready) return false;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1) return false;
+
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (::bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(fd, 8) != 0) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool TcpSocket::accept(TcpSocket& client) {
+	client.close();
+	client.fd = ::accept(fd, nullptr, nullptr);
+	return client.isOpen();
+}
+
+void TcpSocket::setTimeout(int ms) {
+#ifdef TARGET_WIN32
+	DWORD timeout = ms;
+#else
+	timeval timeout = { ms / 1000, (ms % 1000) * 1000 };
+#endif
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+}
+
+void TcpSocket::close() {
+	if (fd != -1) closeSocket(fd);
+	fd = -1;
+}
+
+bool TcpSocket::sendAll(const void* data, size_t size) {
+	const char* p = (const char*)data;
+	while (size > 0) {
+		int n = send(fd, p, (int)std::min(size, (size_t)1 << 20), sendFlags);
+		if (n <= 0) return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool TcpSocket::recvAll(void* data, size_t size) {
+	char* p = (char*)data;
+	while (size > 0) {
+		int n = recv(fd, p, (int)std::min(size, (size_t)1 << 20), 0);
+		if (n <= 0) return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool TcpSocket::sendMessage(const string& msg) {
+	uint32_t size = htonl((uint32_t)msg.size());
+	return sendAll(&size, sizeof(size)) && sendAll(msg.data(), msg.size());
+}
+
+bool TcpSocket::recvMessage(string& msg) {
+	uint32_t size;
+	if (!recvAll(&size, sizeof(size))) return false;
+	size = ntohl(size);
+	if (size > (64u << 20)) return false;
+	msg.resize(size);
+	return size == 0 || recvAll(&msg[0], size);
+}
+
+//--------------------------------------------------------------
+//farms tiles out to every worker in renderWorkers.  Workers pull tiles
+//from a shared queue, so faster machines simply take more of them.  A
+//tile whose worker fails is put back for another worker; after
+//tileRetries failures (or once no worker is left) it is rendered here.
+//Tiles come back as raw floats, so workers must share our byte order.
+void ofApp::renderDistributed(const vector<RenderTile>& tiles, TileSink& sink) {
+	struct TileJob {
+		RenderTile tile;
+		int attempts;
+	};
+
+	string snapshot = saveSnapshot();
+	deque<TileJob> queue;
+	vector<RenderTile> local;
+	int inFlight = 0;
+	mutex lock;
+	condition_variable changed;
+
+	for (const RenderTile& tile : tiles) queue.push_back(TileJob{ tile, 0 });
+
+	auto work = [&](const string& address) {
+		vector<string> hostPort = ofSplitString(address, ":");
+		TcpSocket socket;
+		if (hostPort.size() != 2 || !socket.connect(hostPort[0], ofToInt(hostPort[1]), 5000) || !socket.sendMessage("scene\n" + snapshot)) {
+			cout << "render worker " << address << " unavailable" << endl;
+			return;
+		}
+		//workers send tiles a row at a time, so this is how long one row may take
+		socket.setTimeout(60000);
+
+		vector<float> rgb;
+		int rendered = 0;
+		while (true) {
+			TileJob job;
+			{
+				unique_lock<mutex> guard(lock);
+				changed.wait(guard, [&] { return !queue.empty() || inFlight == 0; });
+				if (queue.empty()) break;
+				job = queue.front();
+				queue.pop_front();
+				inFlight++;
+			}
+
+			const RenderTile& t = job.tile;
+			rgb.resize(t.w * t.h * 3);
+			bool ok = socket.sendMessage("tile " + ofToString(t.x) + " " + ofToString(t.y) + " " + ofToString(t.w) + " " + ofToString(t.h))
+				&& socket.recvAll(rgb.data(), rgb.size() * sizeof(float));
+			if (ok) sink.writeTile(t, rgb.data());
+
+			{
+				lock_guard<mutex> guard(lock);
+				inFlight--;
+				if (!ok) {
+					if (++job.attempts > tileRetries) local.push_back(t);
+					else queue.push_front(job);
+				}
+			}
+			changed.notify_all();
+
+			if (!ok) {
+				cout << "render worker " << address << " dropped after " << rendered << " tiles" << endl;
+				return;
+			}
+			rendered++;
+		}
+		socket.sendMessage("done");
+		cout << "render worker " << address << " rendered " << rendered << " tiles" << endl;
+	};
+
+	vector<thread> threads;
+	for (const string& address : renderWorkers) threads.push_back(thread(work, address));
+	for (thread& t : threads) t.join();
+
+	//whatever the workers could not do
+	for (const TileJob& job : queue) local.push_back(job.tile);
+	if (!local.empty()) {
+		cout << "rendering " << local.size() << " tiles locally" << endl;
+		renderTiles(local, sink);
+	}
+}
+
+//--------------------------------------------------------------
+//render worker: waits for a coordinator, loads its scene snapshot and
+//renders tiles until the coordinator is done, then waits for the next
+int ofApp::runWorker(int port) {
+	TcpSocket server;
+	if (!server.listen(port)) {
+		cout << "render worker: cannot listen on port " << port << endl;
+		return 1;
+	}
+	cout << "render worker listening on port " << port << endl;
+
+	vector<float> rgb;
+	while (true) {
+		TcpSocket client;
+		if (!server.accept(client)) continue;
+
+		bool haveScene = false;
+		string msg;
+		while (client.recvMessage(msg)) {
+			if (msg.compare(0, 6, "scene\n") == 0) {
+				haveScene = loadSnapshot(msg.substr(6));
+				if (!haveScene) break;
+				bakeOcclusion();
+				cacheIrradiance();
+				shadeFn = selectShade();
+			}
+			else if (msg.compare(0, 5, "tile ") == 0 && haveScene) {
+				RenderTile t;
+				istringstream in(msg.substr(5));
+				in >> t.x >> t.y >> t.w >> t.h;
+				if (!in || t.x < 0 || t.y < 0 || t.w <= 0 || t.h <= 0 || t.x + t.w > settings.width || t.y + t.h > settings.height) break;
+
+				//one row at a time, so the coordinator hears from us well within
+				//its timeout however slow the whole tile is
+				rgb.resize(t.w * 3);
+				bool sent = true;
+				for (int y = 0; y < t.h && sent; y++) {
+					renderTile(RenderTile{ t.x, t.y + y, t.w, 1 }, rgb.data());
+					sent = client.sendAll(rgb.data(), rgb.size() * sizeof(float));
+				}
+				if (!sent) break;
+			}
+			else break;                 //"done", or something we do not understand
+		}
+	}
+	return 0;
+}
 
-	ofColor closest;
-	float distance = FLT_MIN;
-	float close = FLT_MAX;
-	closestIndex = 0;
-	for (int i = 0; i < image.getWidth(); i++) {
-		for (int j = 0; j < image.getHeight(); j++) {
-			background = true;																//reset variables every pixel
-			distance = FLT_MIN;
-			close = FLT_MAX;
-			closestIndex = 0;
-
-			float u = (i + .5) / image.getWidth();
-			float v = 1 - (j + .5) / image.getHeight();
-
-			Ray r = renderCam.getRay(u, v);
-			for (int k = 0; k < scene.size(); k++) {
-				if (scene[k]->intersect(r, scene[k]->intersectionPoint, glm::vec3(0, 1, 0))) {
-					background = false;														//if intersected with scene object, pixel is not background
-
-					distance = glm::distance(r.p, scene[k]->position);						//calculate distance of intersection
-					if (distance < close)													//if current object is closest to viewplane
-					{
-						closestIndex = k;													//save index of closest object
-						close = distance;													//set threshold to new closest distance
+//--------------------------------------------------------------
+//forks renderProcesses children that pull tiles from a shared counter.
+//Finished tiles go through a small ring of shared tile slots that this
+//process drains into the sink while the children work, so memory stays
+//proportional to the tiles in flight, not to the image.
+//fork() gives every child a private copy-on-write snapshot of the scene
+//as it is right now, so nothing the editor does can race with them.
+//Tiles a child never delivered (it crashed) are rendered here afterwards.
+void ofApp::renderForked(const vector<RenderTile>& tiles, TileSink& sink) {
+#ifdef TARGET_WIN32
+	cout << "multi-process rendering needs fork(), rendering in process" << endl;
+	renderTiles(tiles, sink);
+#else
+	struct SharedHeader {
+		atomic<int> nextTile;
+	};
+	struct Slot {
+		atomic<int> state;          // 0 free, 1 being rendered, 2 ready for the sink
+		int tile;
+	};
+	enum { FREE, RENDERING, READY };
+
+	//shared layout: header, slots, then one tile of pixels per slot
+	int slotCount = renderProcesses * 2;
+	size_t slotFloats = settings.tileSize * settings.tileSize * 3;
+	size_t slotsOffset = (sizeof(SharedHeader) + 15) & ~(size_t)15;
+	size_t pixelsOffset = (slotsOffset + slotCount * sizeof(Slot) + 15) & ~(size_t)15;
+	size_t size = pixelsOffset + slotCount * slotFloats * sizeof(float);
+
+	void* shared = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		cout << "could not map shared tile slots, rendering in process" << endl;
+		renderTiles(tiles, sink);
+		return;
+	}
+	SharedHeader* header = new (shared) SharedHeader();
+	header->nextTile = 0;
+	Slot* slots = (Slot*)((char*)shared + slotsOffset);
+	for (int i = 0; i < slotCount; i++) {
+		new (&slots[i]) Slot();
+		slots[i].state = FREE;
+		slots[i].tile = -1;
+	}
+	float* slotPixels = (float*)((char*)shared + pixelsOffset);
+
+	cout << "rendering with " << renderProcesses << " processes" << endl;
+
+	vector<pid_t> children;
+	for (int i = 0; i < renderProcesses; i++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			//child - render until the tiles run out, then leave without
+			//running any of the parent's exit handlers
+			int next;
+			while ((next = header->nextTile.fetch_add(1)) < (int)tiles.size()) {
+				int s = -1;
+				while (s < 0) {
+					for (int j = 0; j < slotCount && s < 0; j++) {
+						int expected = FREE;
+						if (slots[j].state.compare_exchange_strong(expected, RENDERING)) s = j;
 					}
+					if (s < 0) usleep(500);      //parent is behind writing tiles out
 				}
+				renderTile(tiles[next], slotPixels + s * slotFloats);
+				slots[s].tile = next;
+				slots[s].state = READY;
 			}
-			if (!background) {
-				//add shading contribution
-				closest = shade(r.evalPoint(close), scene[closestIndex]->getNormal(glm::vec3(0, 0, 0)), scene[closestIndex]->diffuseColor, close, ofColor::lightGray, power, r);
-				image.setColor(i, j, closest);
+			_exit(0);
+		}
+		if (pid > 0) children.push_back(pid);
+	}
+
+	//hand ready slots to the sink until every child has exited
+	vector<bool> written(tiles.size(), false);
+	auto drain = [&]() {
+		bool any = false;
+		for (int i = 0; i < slotCount; i++) {
+			if (slots[i].state == READY) {
+				int t = slots[i].tile;
+				sink.writeTile(tiles[t], slotPixels + i * slotFloats);
+				written[t] = true;
+				slots[i].state = FREE;
+				any = true;
 			}
-			else if (background) {
-				image.setColor(i, j, ofColor::black);
+		}
+		return any;
+	};
+	vector<bool> exited(children.size(), false);
+	int running = children.size();
+	while (running > 0) {
+		if (drain()) continue;
+		for (int i = 0; i < children.size(); i++) {
+			if (!exited[i] && waitpid(children[i], nullptr, WNOHANG) == children[i]) {
+				exited[i] = true;
+				running--;
 			}
 		}
+		usleep(1000);
 	}
+	drain();
 
-	image.save("output.png");
-	image.load("output.png");
+	vector<RenderTile> missing;
+	for (int i = 0; i < tiles.size(); i++) {
+		if (!written[i]) missing.push_back(tiles[i]);
+	}
+	if (!missing.empty()) renderTiles(missing, sink);
 
-	cout << "render saved" << endl;
+	munmap(shared, size);
+#endif
 }
 
-
 //--------------------------------------------------------------
 //calculates lambert shading
+//l is the unit vector towards the light, irradiance the light's
+//attenuated intensity at the point (see attenuation())
+//returns shaded color
+glm::vec3 ofApp::lambert(const glm::vec3& norm, const glm::vec3& diffuse, const glm::vec3& l, float irradiance) const {
+	return diffuse * irradiance * glm::max(zero, glm::dot(norm, l));
+}
+
+
+//--------------------------------------------------------------
+//calculates lambert + specular (blinn-phong) shading
 //returns shaded color
-ofColor ofApp::lambert(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, float distance, Ray r, Light light) {
-	ofColor lambert = ofColor(0, 0, 0);
-	float zero = 0.0;
-	//
-	//distance = light.pos - p
-	//
-	glm::vec3 l = glm::normalize(light.position - p);
-	lambert += diffuse * (light.intensity / distance * distance) * (glm::max(zero, glm::dot(norm, l)));
+glm::vec3 ofApp::phong(const glm::vec3& p, const glm::vec3& norm, const glm::vec3& diffuse, const glm::vec3& specular, float power, const glm::vec3& l, float irradiance) const {
+	glm::vec3 v = glm::normalize(renderCam.position - p);
+	glm::vec3 h = glm::normalize(l + v);
 
-	return lambert;
+	return lambert(norm, diffuse, l, irradiance) + specular * irradiance * glm::pow(glm::max(zero, glm::dot(norm, h)), power);
+}
+
+//--------------------------------------------------------------
+//calculates lambert shading from spot lights
+//returns shaded color
+glm::vec3 ofApp::spotLightLambert(const glm::vec3& p, const glm::vec3& norm, const glm::vec3& diffuse, const SpotLightPrim& light) const {
+	glm::vec3 toLight = light.position - p;
+	float distance2 = glm::dot(toLight, toLight);
+	if (distance2 * light.invRange2 >= 1) return glm::vec3(0);
+	glm::vec3 l = toLight / sqrt(distance2);
+
+	//if p is inside cone illumination area
+	if (glm::dot(-l, light.direction) >= light.cosAngle) {
+		return lambert(norm, diffuse, l, attenuation(light.intensity, distance2, light.invRange2));
+	}
+	return glm::vec3(0);
 }
 
 
 //--------------------------------------------------------------
-//calculates all shading including:
-// lambert
-// phong
-// ambient
+//adds shading contribution of every light, with moving lights
+//where they are at time
+//calculates shadows (shadow rays see the scene at the same time)
 //returns shaded color
-ofColor ofApp::phong(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, const ofColor specular, float power, float distance, Ray r, Light light) {
-	ofColor phong = ofColor(0, 0, 0);
-	glm::vec3 h = glm::vec3(0);
+//
+//every feature test below is on a template parameter, so each
+//instantiation compiles down to only the work its render needs
+//
+//with several lights only the ones whose range reaches p (from the
+//light grids) and the unbounded ones are visited
+template<bool Shadows, bool SpotLights, bool Specular, int LightBucket, int Ambient>
+glm::vec3 ofApp::shade(const glm::vec3& p, const glm::vec3& norm, const glm::vec3& diffuse, const glm::vec3& specular, float time, int object) const {
+	glm::vec3 shaded = glm::vec3(0);
+
+	//light from the environment map, or a constant ambient term darkened
+	//by nearby geometry
+	if (Ambient == AmbientEnvironment) shaded += ambient<Shadows>(p, norm, diffuse, time);
+	if (Ambient == AmbientOcclusion) shaded += diffuse * (settings.aoIntensity * occlusion(p, norm, object, time));
+	if (Ambient == AmbientIrradiance) shaded += diffuse * indirect(p, norm, time);
+
+	//point lights
+	if (LightBucket == 1) shaded += shadePointLight<Shadows, Specular>(prims.lights[0], p, norm, diffuse, specular, time);
+	if (LightBucket == 2) {
+		LightGrid::Range reach = prims.lightGrid.lightsAt(p);
+		for (const int* i = reach.begin; i != reach.end; i++) {
+			shaded += shadePointLight<Shadows, Specular>(prims.lights[*i], p, norm, diffuse, specular, time);
+		}
+		for (int i : prims.lightGrid.unbounded) {
+			shaded += shadePointLight<Shadows, Specular>(prims.lights[i], p, norm, diffuse, specular, time);
+		}
+	}
 
-	glm::vec3 l = glm::normalize(light.position - p);
-	glm::vec3 v = glm::normalize(renderCam.position - p);
-	h = glm::normalize(l + v);
+	//spot lights shading
+	if (SpotLights) {
+		LightGrid::Range reach = prims.spotLightGrid.lightsAt(p);
+		for (const int* i = reach.begin; i != reach.end; i++) {
+			SpotLightPrim spot = prims.spotLights[*i];
+			spot.position += time * spot.motion;
+			shaded += spotLightLambert(p, norm, diffuse, spot);
+		}
+		for (int i : prims.spotLightGrid.unbounded) {
+			SpotLightPrim spot = prims.spotLights[i];
+			spot.position += time * spot.motion;
+			shaded += spotLightLambert(p, norm, diffuse, spot);
+		}
+	}
 
-	float distance1 = glm::distance(light.position, p);
+	return shaded;
+}
 
+//--------------------------------------------------------------
+//one point light's contribution to shade()
+template<bool Shadows, bool Specular>
+glm::vec3 ofApp::shadePointLight(const PointLightPrim& light, const glm::vec3& p, const glm::vec3& norm, const glm::vec3& diffuse, const glm::vec3& specular, float time) const {
+	//lights out of range are skipped before any other work
+	glm::vec3 toLight = light.position + time * light.motion - p;
+	float distance2 = glm::dot(toLight, toLight);
+	if (distance2 * light.invRange2 >= 1) return glm::vec3(0);
+	float lightDistance = sqrt(distance2);
+	glm::vec3 l = toLight / lightDistance;
+
+	//test for shadows - anything between the point and the light
+	if (Shadows) {
+		if (prims.occluded(Ray(p + norm * .001f, l, time), lightDistance)) return glm::vec3(0);
+	}
 
-	phong += (lambert(p, norm, diffuse, distance1, r, light)) + (specular * (light.intensity / distance1 * distance1) * glm::pow(glm::max(zero, glm::dot(norm, h)), power));
+	//add shading contribution for current light
+	float irradiance = attenuation(light.intensity, distance2, light.invRange2);
+	if (Specular) return phong(p, norm, diffuse, specular, settings.power, l, irradiance);
+	return lambert(norm, diffuse, l, irradiance);
+}
 
+//--------------------------------------------------------------
+//diffuse light from the environment map: settings.environmentSamples
+//directions drawn from its cdf, each weighted by cosine / pdf (a
+//lambertian surface under a uniform white environment of radiance 1
+//comes out at its diffuse color).  The sample pattern is a Halton
+//(2, 3) set shifted by pointShift(p).
+template<bool Shadows>
+glm::vec3 ofApp::ambient(const glm::vec3& p, const glm::vec3& norm, const glm::vec3& diffuse, float time) const {
+	glm::vec2 shift = pointShift(p);
+	glm::vec3 sum(0);
+	int n = settings.environmentSamples;
+	for (int k = 0; k < n; k++) {
+		glm::vec2 u = glm::fract(glm::vec2(halton(k, 2), halton(k, 3)) + shift);
+		float pdf;
+		glm::vec3 d = environment.sample(u, pdf);
+		float cosine = glm::dot(norm, d);
+		if (pdf <= 0 || cosine <= 0) continue;
+		if (Shadows && prims.occluded(Ray(p + norm * .001f, d, time), FLT_MAX)) continue;
+		sum += environment.lookup(d) * (cosine / pdf);
+	}
+	return diffuse * sum * (settings.environmentIntensity / (PI * n));
+}
 
-	return phong;
+//--------------------------------------------------------------
+//unoccluded share of the hemisphere around norm, from the bake when
+//there is one for the object
+float ofApp::occlusion(const glm::vec3& p, const glm::vec3& norm, int object, float time) const {
+	if (settings.aoBake && aoCache.baked(object)) return aoCache.at(object, p);
+	return AoCache::cast(prims, p, norm, time, settings.aoSamples, settings.aoDistance);
 }
 
 //--------------------------------------------------------------
-//calculates lambert shading from spot lights
-//returns shaded color
+//brings aoCache up to date for the prims (before every render, cheap
+//when nothing changed)
+void ofApp::bakeOcclusion() {
+	if (settings.aoBake && ambientMode() == AmbientOcclusion) aoCache.bake(prims, settings.aoDistance, settings.aoSamples);
+}
+
 //--------------------------------------------------------------
+//one bounce of diffuse light arriving at p, from the cache when a
+//record covers p, otherwise computed here (and not kept, so every
+//thread and process sees the same cache)
+glm::vec3 ofApp::indirect(const glm::vec3& p, const glm::vec3& norm, float time) const {
+	glm::vec3 irradiance;
+	if (irradianceCache.lookup(p, norm, irradiance)) return irradiance;
+	return irradianceRecord(p, norm, time).irradiance;
+}
+
 //--------------------------------------------------------------
+//settings.irradianceSamples cosine weighted rays (Halton (2, 3) shifted
+//by pointShift(p)), each bringing back the direct light on what it hits
+//(bounceFn) or the environment behind it.  The mean of those is what a
+//lambertian surface of diffuse color 1 reflects.
+IrradianceCache::Record ofApp::irradianceRecord(const glm::vec3& p, const glm::vec3& norm, float time) const {
+	glm::vec2 shift = pointShift(p);
+	glm::vec3 origin = p + norm * .001f;
+	glm::vec3 sum(0);
+	float inverseDistances = 0;
+	int n = settings.irradianceSamples;
+	for (int k = 0; k < n; k++) {
+		Ray ray(origin, cosineDirection(norm, glm::fract(glm::vec2(halton(k, 2), halton(k, 3)) + shift)), time);
+		RayHit hit;
+		if (!prims.intersect(ray, hit)) {
+			sum += environment.lookup(ray.d) * settings.environmentIntensity;
+			continue;
+		}
+		inverseDistances += 1 / std::max(hit.t, .001f);
+		sum += (this->*bounceFn)(ray.evalPoint(hit.t), hit.normal, prims.diffuse[hit.object], glm::vec3(0), time, hit.object);
+	}
+
+	IrradianceCache::Record record;
+	record.position = p;
+	record.normal = norm;
+	record.irradiance = sum / (float)n;
+	float radius = (inverseDistances > 0) ? n / inverseDistances : FLT_MAX;
+	record.radius = glm::clamp(radius, irradianceCache.minRadius, irradianceCache.maxRadius);
+	return record;
+}
+
+template<bool Shadows, bool SpotLights, bool Specular, int LightBucket>
+static ofApp::ShadeFn selectAmbient(int ambient) {
+	if (ambient == ofApp::AmbientEnvironment) return &ofApp::shade<Shadows, SpotLights, Specular, LightBucket, ofApp::AmbientEnvironment>;
+	if (ambient == ofApp::AmbientOcclusion) return &ofApp::shade<Shadows, SpotLights, Specular, LightBucket, ofApp::AmbientOcclusion>;
+	if (ambient == ofApp::AmbientIrradiance) return &ofApp::shade<Shadows, SpotLights, Specular, LightBucket, ofApp::AmbientIrradiance>;
+	return &ofApp::shade<Shadows, SpotLights, Specular, LightBucket, ofApp::AmbientNone>;
+}
+
+template<bool Shadows, bool SpotLights, bool Specular>
+static ofApp::ShadeFn selectLightBucket(int lightCount, int ambient) {
+	if (lightCount == 0) return selectAmbient<Shadows, SpotLights, Specular, 0>(ambient);
+	if (lightCount == 1) return selectAmbient<Shadows, SpotLights, Specular, 1>(ambient);
+	return selectAmbient<Shadows, SpotLights, Specular, 2>(ambient);
+}
+
+template<bool Shadows, bool SpotLights>
+static ofApp::ShadeFn selectSpecular(bool specular, int lightCount, int ambient) {
+	return specular ? selectLightBucket<Shadows, SpotLights, true>(lightCount, ambient) : selectLightBucket<Shadows, SpotLights, false>(lightCount, ambient);
+}
+
+template<bool Shadows>
+static ofApp::ShadeFn selectSpotLights(bool spotLights, bool specular, int lightCount, int ambient) {
+	return spotLights ? selectSpecular<Shadows, true>(specular, lightCount, ambient) : selectSpecular<Shadows, false>(specular, lightCount, ambient);
+}
+
 //--------------------------------------------------------------
+//the environment map wins over indirect light, which wins over ambient
+//occlusion
+ofApp::AmbientMode ofApp::ambientMode() const {
+	if (!environment.empty() && settings.environmentSamples > 0 && settings.environmentIntensity > 0) return AmbientEnvironment;
+	if (settings.irradianceSamples > 0) return AmbientIrradiance;
+	if (settings.aoSamples > 0 && settings.aoIntensity > 0) return AmbientOcclusion;
+	return AmbientNone;
+}
+
 //--------------------------------------------------------------
+//picks the shade() instantiation for the current settings and lights
+//(called once per render, after buildPrims())
+ofApp::ShadeFn ofApp::selectShade() const {
+	bool spots = !prims.spotLights.empty();
+	int lightCount = prims.lights.size();
+	int ambient = ambientMode();
+	return settings.shadows ? selectSpotLights<true>(spots, settings.specular, lightCount, ambient) : selectSpotLights<false>(spots, settings.specular, lightCount, ambient);
+}
 
-ofColor ofApp::spotLightLambert(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, float distance, Ray r, spotLight light) {
-	ofColor lambert = ofColor(0, 0, 0);
-	float zero = 0.0;
-	float inf = FLT_MAX;
-	glm::vec3 point, normal;
-	//
-	float distance1 = glm::distance(light.position, p);
-	//
-	//if p is inside cone illumination area
+//--------------------------------------------------------------
+//shade() for the far end of an indirect ray: direct diffuse light only
+ofApp::ShadeFn ofApp::selectBounce() const {
+	bool spots = !prims.spotLights.empty();
+	int lightCount = prims.lights.size();
+	return settings.shadows ? selectSpotLights<true>(spots, false, lightCount, AmbientNone) : selectSpotLights<false>(spots, false, lightCount, AmbientNone);
+}
 
+//--------------------------------------------------------------
+//hash of what cacheIrradiance() reads: the prims, the pinhole camera
+//and the pixel grid it shoots through, and the settings that light the
+//records
+string ofApp::irradianceKey() const {
+	ostringstream out;
+	out << setprecision(9) << settings.width << " " << settings.height << " " << settings.shadows << " " << settings.intensity << " " << settings.spotLightIntensity
+		<< " " << settings.lightRange << " " << settings.shutter << " " << settings.environmentIntensity << " " << settings.irradianceSamples << " " << settings.irradianceError << "\n";
+	writeVec(out, renderCam.position);
+	out << " " << renderCam.view.min.x << " " << renderCam.view.min.y << " " << renderCam.view.max.x << " " << renderCam.view.max.y << " " << renderCam.view.position.z << "\n";
+	out << quoted(environment.hash) << "\n";
+	prims.write(out);
+	return RenderCache::hash(out.str());
+}
 
-	Ray s = Ray(renderCam.position, glm::normalize(p - renderCam.position));
-	if (glm::intersectRaySphere(s.p, s.d, light.aimPoint, light.coneAngle, point, normal)) {
-		glm::vec3 l = glm::normalize(light.position - p);
-		lambert += diffuse * (light.intensity / distance1 * distance1) * (glm::max(zero, glm::dot(norm, l)));
-	}  
+//--------------------------------------------------------------
+//fills irradianceCache from the pixels at the corners of a grid, 256
+//pixels apart and halving down to 4: each pass adds a record wherever
+//no earlier one covers the primary hit.  Records of a pass are worked
+//out on every core, then inserted in pixel order, so the cache comes
+//out the same however many threads there are.  Kept as long as nothing
+//the records depend on changes (irradianceKey()), so an estimate's
+//cache serves the render and sample counts, density or the lens don't
+//throw it away.
+void ofApp::cacheIrradiance() {
+	bounceFn = selectBounce();
+	if (ambientMode() != AmbientIrradiance) {
+		irradianceCache.clear();
+		return;
+	}
+	string key = irradianceKey();
+	if (key == irradianceCache.key) return;
+	irradianceCache.clear();
+	irradianceCache.key = key;
+
+	uint64_t start = ofGetElapsedTimeMillis();
+	float time = settings.shutter * sampleTime(0);
+	for (int step = 256; step >= 4; step /= 2) {
+		int rows = (settings.height + step - 1) / step;
+		vector<vector<IrradianceCache::Record>> found(rows);
+		parallelFor(rows, [&](size_t row) {
+			int y = row * step;
+			for (int x = 0; x < settings.width; x += step) {
+				Ray ray = renderCam.getRay((x + .5f) / settings.width, 1 - (y + .5f) / settings.height);
+				ray.time = time;
+				RayHit hit;
+				glm::vec3 irradiance;
+				if (!prims.intersect(ray, hit)) continue;
+				glm::vec3 p = ray.evalPoint(hit.t);
+				if (!irradianceCache.lookup(p, hit.normal, irradiance)) found[row].push_back(IrradianceCache::Record{ p, hit.normal });
+			}
+		});
+
+		vector<IrradianceCache::Record> records;
+		for (const vector<IrradianceCache::Record>& row : found) records.insert(records.end(), row.begin(), row.end());
+		if (irradianceCache.nodes.empty()) {
+			if (records.empty()) return;
+			Bounds bounds;
+			for (const IrradianceCache::Record& r : records) bounds.grow(r.position);
+			irradianceCache.reset(bounds, settings.irradianceError);
+		}
+		parallelFor(records.size(), [&](size_t i) {
+			records[i] = irradianceRecord(records[i].position, records[i].normal, time);
+		});
+		for (const IrradianceCache::Record& r : records) irradianceCache.insert(r);
+	}
+	cout << "irradiance cache: " << irradianceCache.records.size() << " records in " << ofGetElapsedTimeMillis() - start << "ms" << endl;
+}
+
+//--------------------------------------------------------------
+//copies the GUI state the renderer depends on
+void ofApp::captureSettings() {
+	settings.width = renderWidth;
+	settings.height = renderHeight;
+	settings.fov = fov;
+	renderCam.aperture = aperture;
+	renderCam.focusDistance = focusDistance;
+	settings.power = power;
+	settings.intensity = intensity;
+	settings.spotLightIntensity = spotLightIntensity;
+	settings.lightRange = lightRange;
+	settings.shadows = shadows;
+	settings.specular = specular;
+	settings.samples = pixelSamples;
+	settings.adaptiveThreshold = adaptiveThreshold;
+	settings.shutter = shutter;
+	settings.environmentIntensity = environmentIntensity;
+	settings.environmentSamples = environmentSamples;
+	settings.aoSamples = aoSamples;
+	settings.aoDistance = aoDistance;
+	settings.aoIntensity = aoIntensity;
+	settings.aoBake = aoBake;
+	settings.irradianceSamples = irradianceSamples;
+	settings.irradianceError = irradianceError;
+
+	//samples concentrate where the mouse is (over the window, which the
+	//preview camera fills the same way the render does), or where
+	//--fovea put them
+	foveate = foveated;
+	foveaSize = foveaRadius;
+	if (foveaOnMouse) foveaFocus = glm::vec2(ofGetMouseX() / (float)ofGetWidth(), ofGetMouseY() / (float)ofGetHeight());
+	renderProcesses = processes;
+	renderBudget = timeBudget;
+	useCache = cacheRenders;
+}
+
+//--------------------------------------------------------------
+//focus in [0, 1] across and down the image, radius as a fraction of the
+//image height
+void SampleDensity::setFovea(const glm::vec2& focus, float radius, float aspect) {
+	width = height = gridSize;
+	weights.resize(width * height);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			glm::vec2 offset((x + .5f) / width - focus.x, (y + .5f) / height - focus.y);
+			float d = glm::length(glm::vec2(offset.x * aspect, offset.y)) / radius;
+			weights[y * width + x] = (d <= 1) ? 1 : std::max(minimum, 1 / (d * d));
+		}
+	}
+}
 
-	return lambert;
+//brightness of the mask (first channel) point sampled onto the grid,
+//white is full density
+bool SampleDensity::loadMask(const string& path) {
+	ofPixels mask;
+	if (!ofLoadImage(mask, path) || mask.getWidth() == 0 || mask.getHeight() == 0) {
+		cout << "could not load sample density mask " << path << endl;
+		clear();
+		return false;
+	}
+	width = height = gridSize;
+	weights.resize(width * height);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			size_t mx = (x * 2 + 1) * mask.getWidth() / (2 * width);
+			size_t my = (y * 2 + 1) * mask.getHeight() / (2 * height);
+			float value = mask.getData()[(my * mask.getWidth() + mx) * mask.getNumChannels()] / 255.0f;
+			weights[y * width + x] = std::max(minimum, value);
+		}
+	}
+	return true;
 }
 
+void SampleDensity::write(ostream& out) const {
+	out << "density " << width << " " << height;
+	for (float w : weights) out << " " << w;
+	out << "\n";
+}
 
-ofColor ofApp::spotLightLambert2(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, float distance, Ray r, spotLight light) {
-	ofColor lambert = ofColor(0, 0, 0);
-	float zero = 0.0;
-	float inf = FLT_MAX;
-	float angle2;
-	glm::vec3 point, normal;
-	//
-	//distance = light.pos - p
-	//
-	//if p is inside cone illumination area
+bool SampleDensity::read(istream& in) {
+	string tag;
+	in >> tag >> width >> height;
+	if (!in || tag != "density" || width < 0 || height < 0 || width * height > gridSize * gridSize) return false;
+	weights.resize(width * height);
+	for (float& w : weights) {
+		in >> w;
+		if (!(w > 0 && w <= 1)) return false;
+	}
+	return (bool)in;
+}
 
-	for (int i = 0; i < light.angle1; i++) {
-		angle2 = light.angle1 + i;
-		Ray s = Ray(light.position, angle2 - (light.position - light.aimPoint));
-		if (glm::intersectRaySphere(s.p, s.d, light.aimPoint, light.coneAngle, point, normal)) {
-			glm::vec3 l = glm::normalize(light.position - p);
-			lambert += diffuse * (light.intensity / distance * distance) * (glm::max(zero, glm::dot(norm, l)));
+//--------------------------------------------------------------
+//reads the radiance (any format oF loads as float pixels - .hdr, .exr,
+//.pfm) and builds the sampling cdfs.  Rows or maps that are all black
+//are sampled uniformly.  A file that doesn't load leaves the current
+//map as it was (a stray file dropped on the window changes nothing).
+bool EnvironmentMap::load(const string& path) {
+	ofFloatPixels pixels;
+	if (!ofLoadImage(pixels, path) || pixels.getWidth() == 0 || pixels.getHeight() == 0) {
+		cout << "could not load environment map " << path << endl;
+		return false;
+	}
+	this->path = path;
+	width = pixels.getWidth();
+	height = pixels.getHeight();
+	int channels = pixels.getNumChannels();
+	const float* data = pixels.getData();
+	radiance.resize(width * height);
+	for (int i = 0; i < width * height; i++) {
+		const float* c = data + i * channels;
+		radiance[i] = (channels >= 3) ? glm::vec3(c[0], c[1], c[2]) : glm::vec3(c[0]);
+	}
+	hash = RenderCache::hash(string((const char*)radiance.data(), radiance.size() * sizeof(glm::vec3)));
+
+	cdf.assign((width + 1) * height, 0);
+	rowCdf.assign(height + 1, 0);
+	for (int y = 0; y < height; y++) {
+		float sinTheta = sin(PI * (y + .5f) / height);
+		float* row = &cdf[y * (width + 1)];
+		for (int x = 0; x < width; x++) {
+			float lum = glm::dot(radiance[y * width + x], glm::vec3(.2126, .7152, .0722));
+			row[x + 1] = row[x] + std::max(lum, 0.0f) * sinTheta;
 		}
+		rowCdf[y + 1] = rowCdf[y] + row[width];
+		for (int x = 1; x <= width; x++) row[x] = (row[width] > 0) ? row[x] / row[width] : (float)x / width;
 	}
+	float total = rowCdf[height];
+	for (int y = 1; y <= height; y++) rowCdf[y] = (total > 0) ? rowCdf[y] / total : (float)y / height;
+	return true;
+}
 
-	return lambert;
+glm::vec3 EnvironmentMap::lookup(const glm::vec3& d) const {
+	if (empty()) return glm::vec3(0);
+	glm::vec2 uv = directionToLatLong(d);
+	int x = glm::clamp((int)(uv.x * width), 0, width - 1);
+	int y = glm::clamp((int)(uv.y * height), 0, height - 1);
+	return radiance[y * width + x];
 }
 
+//picks a pixel from the cdfs, then a point inside it from where u fell
+//in the pixel's share of each cdf
+glm::vec3 EnvironmentMap::sample(const glm::vec2& u, float& pdf) const {
+	int y = glm::clamp((int)(std::upper_bound(rowCdf.begin(), rowCdf.end(), u.y) - rowCdf.begin()) - 1, 0, height - 1);
+	const float* row = &cdf[y * (width + 1)];
+	int x = glm::clamp((int)(std::upper_bound(row, row + width + 1, u.x) - row) - 1, 0, width - 1);
+
+	float rowShare = rowCdf[y + 1] - rowCdf[y], share = row[x + 1] - row[x];
+	float fy = (rowShare > 0) ? (u.y - rowCdf[y]) / rowShare : .5f;
+	float fx = (share > 0) ? (u.x - row[x]) / share : .5f;
+	glm::vec2 uv((x + fx) / width, (y + fy) / height);
+
+	//probability of the pixel over its solid angle
+	float sinTheta = sin(PI * uv.y);
+	pdf = (sinTheta > 0) ? rowShare * share * width * height / (2 * PI * PI * sinTheta) : 0;
+	return latLongToDirection(uv);
+}
 
 //--------------------------------------------------------------
-//adds shading contribution
-//calculates shadows
-//returns shaded color
-ofColor ofApp::shade(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, float distance, const ofColor specular, float power, Ray r) {
-	ofColor shaded = (0, 0, 0);
-	glm::vec3 p1 = p;
+//one map per sphere and plane, every texel cast from the surface point
+//at its center, a row of texels per job for parallelFor()
+void AoCache::bake(const ScenePrims& prims, float distance, int samples) {
+	int rays = samples * bakeScale;
+	ostringstream geometry;
+	geometry << setprecision(9) << distance << " " << rays;
+	bool moving = false;
+	for (const SpherePrim& s : prims.spheres) {
+		geometry << " " << s.center.x << " " << s.center.y << " " << s.center.z << " " << s.radius << " " << s.object;
+		moving = moving || s.motion != glm::vec3(0);
+	}
+	for (const PlanePrim& pl : prims.planes) {
+		geometry << " " << pl.position.x << " " << pl.position.y << " " << pl.position.z << " " << pl.normal.x << " " << pl.normal.y << " " << pl.normal.z
+			<< " " << pl.width << " " << pl.height << " " << pl.object;
+		moving = moving || pl.motion != glm::vec3(0);
+	}
+	string hash = RenderCache::hash(geometry.str());
+	if (hash == key) return;
+	clear();
+	key = hash;
+	if (moving) return;
+
+	uint64_t start = ofGetElapsedTimeMillis();
+	float texel = distance / 4;
+	maps.resize(prims.diffuse.size());
+	for (const SpherePrim& s : prims.spheres) {
+		Map& m = maps[s.object];
+		m.sphere = true;
+		m.center = s.center;
+		m.size = glm::vec2(s.radius);
+		m.width = glm::clamp((int)ceil(2 * PI * s.radius / texel), 8, maxTexels);
+		m.height = std::max(4, m.width / 2);
+	}
+	for (const PlanePrim& pl : prims.planes) {
+		Map& m = maps[pl.object];
+		m.center = pl.position;
+		m.axisU = glm::normalize(fabs(pl.normal.x) < .9f ? glm::vec3(1, 0, 0) - pl.normal * pl.normal.x : glm::vec3(0, 0, 1) - pl.normal * pl.normal.z);
+		m.axisV = glm::cross(pl.normal, m.axisU);
+		m.size = glm::vec2(pl.width, pl.height);
+		m.width = glm::clamp((int)ceil(pl.width / texel), 2, maxTexels);
+		m.height = glm::clamp((int)ceil(pl.height / texel), 2, maxTexels);
+	}
 
-	//loop through all lights
-	for (int i = 0; i < light.size(); i++) {
-		blocked = false;
+	//(map, texel) jobs, handed out in chunks of a row
+	vector<glm::ivec2> rows;
+	size_t texels = 0;
+	for (int i = 0; i < (int)maps.size(); i++) {
+		maps[i].values.resize(maps[i].width * maps[i].height);
+		texels += maps[i].values.size();
+		for (int y = 0; y < maps[i].height; y++) rows.push_back(glm::ivec2(i, y));
+	}
+	parallelFor(rows.size(), [&](size_t r) {
+		Map& m = maps[rows[r].x];
+		int y = rows[r].y;
+		for (int x = 0; x < m.width; x++) {
+			glm::vec3 n;
+			glm::vec3 p = m.texelPoint(x, y, n);
+			m.values[y * m.width + x] = cast(prims, p, n, 0, rays, distance);
+		}
+	});
+	cout << "baked ambient occlusion: " << texels << " texels in " << ofGetElapsedTimeMillis() - start << "ms" << endl;
+}
 
-		//test for shadows
-		if (closestIndex < 2) {								//if the closest object is one of the planes
-			if (scene[0]->intersect(r, p1, glm::vec3(0, 1, 0))) {													//check if current point intersected with ground plane
+glm::vec2 AoCache::Map::uv(const glm::vec3& p) const {
+	if (sphere) return directionToLatLong(glm::normalize(p - center));
+	return glm::vec2(glm::dot(p - center, axisU) / size.x + .5f, glm::dot(p - center, axisV) / size.y + .5f);
+}
 
-				Ray shadowRay = Ray(scene[0]->getIntersectionPoint(), light[i]->position - scene[0]->getIntersectionPoint());
+glm::vec3 AoCache::Map::texelPoint(int x, int y, glm::vec3& normal) const {
+	glm::vec2 t((x + .5f) / width, (y + .5f) / height);
+	if (sphere) {
+		normal = latLongToDirection(t);
+		return center + normal * size.x;
+	}
+	normal = glm::cross(axisU, axisV);
+	return center + axisU * ((t.x - .5f) * size.x) + axisV * ((t.y - .5f) * size.y);
+}
 
-				//check all sphere objects
-				for (int j = 2; j < scene.size(); j++) {
-					if (scene[j]->intersect(shadowRay, p1, scene[j]->getNormal(p1))) {
-						blocked = true;
-					}
-				}
+float AoCache::at(int object, const glm::vec3& p) const {
+	const Map& m = maps[object];
+	glm::vec2 uv = m.uv(p);
+
+	//texel centers are at (i + .5) / size; spheres wrap around in u
+	float fx = uv.x * m.width - .5f, fy = uv.y * m.height - .5f;
+	int x0 = (int)floor(fx), y0 = (int)floor(fy);
+	float tx = fx - x0, ty = fy - y0;
+	auto texel = [&m](int x, int y) {
+		x = m.sphere ? (x % m.width + m.width) % m.width : glm::clamp(x, 0, m.width - 1);
+		y = glm::clamp(y, 0, m.height - 1);
+		return m.values[y * m.width + x];
+	};
+	return glm::mix(glm::mix(texel(x0, y0), texel(x0 + 1, y0), tx), glm::mix(texel(x0, y0 + 1), texel(x0 + 1, y0 + 1), tx), ty);
+}
+
+//cosine weighted Halton (2, 3) directions, shifted by pointShift(p)
+float AoCache::cast(const ScenePrims& prims, const glm::vec3& p, const glm::vec3& norm, float time, int n, float distance) {
+	glm::vec2 shift = pointShift(p);
+	glm::vec3 origin = p + norm * .001f;
+	int open = 0;
+	for (int k = 0; k < n; k++) {
+		glm::vec3 d = cosineDirection(norm, glm::fract(glm::vec2(halton(k, 2), halton(k, 3)) + shift));
+		if (!prims.occluded(Ray(origin, d, time), distance)) open++;
+	}
+	return (float)open / n;
+}
+
+//--------------------------------------------------------------
+//the root is a cube around bounds, a little larger so points on its
+//faces still fall inside
+void IrradianceCache::reset(const Bounds& bounds, float error) {
+	records.clear();
+	nodes.clear();
+	this->error = error;
+	Node root;
+	root.center = bounds.center();
+	root.half = std::max(std::max(bounds.max.x - bounds.min.x, std::max(bounds.max.y - bounds.min.y, bounds.max.z - bounds.min.z)) * .5f, minRadius) * 1.01f;
+	nodes.push_back(root);
+}
+
+//a record reaches error x radius from its position, so it goes down to
+//the smallest node whose half side still covers that
+void IrradianceCache::insert(const Record& record) {
+	int index = records.size();
+	records.push_back(record);
+	float reach = error * record.radius;
+	glm::vec3 offset = glm::abs(record.position - nodes[0].center);
+	bool inside = std::max(offset.x, std::max(offset.y, offset.z)) <= nodes[0].half;
+
+	int n = 0;
+	while (inside && nodes[n].half * .5f >= reach) {
+		if (nodes[n].children < 0) {
+			int first = nodes.size();
+			for (int i = 0; i < 8; i++) {
+				Node child;
+				child.half = nodes[n].half * .5f;
+				child.center = nodes[n].center + glm::vec3((i & 1) ? child.half : -child.half, (i & 2) ? child.half : -child.half, (i & 4) ? child.half : -child.half);
+				nodes.push_back(child);
 			}
+			nodes[n].children = first;
+		}
+		const glm::vec3& c = nodes[n].center;
+		n = nodes[n].children + (record.position.x > c.x) + 2 * (record.position.y > c.y) + 4 * (record.position.z > c.z);
+	}
+	nodes[n].records.push_back(index);
+}
+
+//weights are Ward's 1 / e less 1 / error, so they fade to 0 at the edge
+//of a record's reach and neighbouring records blend without seams.  A
+//record behind p (p is in front of its surface, seeing light the record
+//did not) is skipped.  Records of a node are at most a node's half side
+//from its cube, so only nodes within that of p are visited.
+bool IrradianceCache::lookup(const glm::vec3& p, const glm::vec3& norm, glm::vec3& irradiance) const {
+	if (nodes.empty()) return false;
+	glm::vec3 sum(0);
+	float weights = 0;
+	int stack[256];             // up to 8 pending nodes per level
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		const Node& node = nodes[stack[--top]];
+		for (int i : node.records) {
+			const Record& r = records[i];
+			glm::vec3 d = p - r.position;
+			float e = glm::length(d) / r.radius + sqrt(std::max(0.0f, 1 - glm::dot(norm, r.normal)));
+			if (e >= error) continue;
+			if (glm::dot(d, (norm + r.normal) * .5f) < -.01f * r.radius) continue;
+			float w = 1 / std::max(e, 1e-4f) - 1 / error;
+			sum += r.irradiance * w;
+			weights += w;
 		}
-		if (!blocked) {
-			//add shading contribution for current light
-			shaded += phong(p, norm, diffuse, specular, power, distance, r, *light[i]);
+		if (node.children < 0) continue;
+		for (int i = 0; i < 8; i++) {
+			const Node& child = nodes[node.children + i];
+			glm::vec3 offset = glm::abs(p - child.center);
+			if (std::max(offset.x, std::max(offset.y, offset.z)) <= 2 * child.half && top < 256) stack[top++] = node.children + i;
 		}
 	}
+	if (weights <= 0) return false;
+	irradiance = sum / weights;
+	return true;
+}
 
-	//pointLights shading
+//--------------------------------------------------------------
+//sets the GUI (and settings, for headless renders) from a preset
+void ofApp::applyPreset(const RenderPreset& preset) {
+	settings.width = std::max(16, (int)(imageWidth * preset.scale));
+	settings.height = std::max(16, (int)(imageHeight * preset.scale));
+	settings.samples = preset.samples;
+	settings.shadows = preset.shadows;
+	settings.specular = preset.specular;
+
+	renderWidth = settings.width;
+	renderHeight = settings.height;
+	pixelSamples = settings.samples;
+	shadows = settings.shadows;
+	specular = settings.specular;
+	cout << preset.name << ": " << settings.width << "x" << settings.height << ", " << settings.samples << " samples per pixel, shadows "
+		<< (settings.shadows ? "on" : "off") << ", specular " << (settings.specular ? "on" : "off") << endl;
+}
 
-	for (int i = 0; i < spotLights.size(); i++) {
-		shaded += spotLightLambert(p, norm, diffuse, distance, r, *spotLights[i]);
+bool ofApp::applyPreset(const string& name) {
+	for (const RenderPreset& preset : renderPresets) {
+		if (name == preset.name) {
+			applyPreset(preset);
+			return true;
+		}
 	}
+	return false;
+}
 
+//--------------------------------------------------------------
+//times the same few hundred primary rays (spread over the image by the
+//Halton sequence) with each feature switched off in turn, then scales
+//the cost per ray up to every sample of the render.  The occlusion bake
+//and irradiance cache are built first and timed as they are (and kept,
+//so the render that follows reuses them).  Needs prims and settings
+//(buildPrims()), leaves both as they were.
+RenderEstimate ofApp::estimateRender() {
+	updateView();
+	updateDensity();
+	vector<Ray> rays;
+	for (int i = 1; i <= 500; i++) {
+		rays.push_back(renderCam.getRay(halton(i, 2), halton(i, 3)));
+		rays.back().time = settings.shutter * sampleTime(i);
+	}
 
+	//seconds per ray, timed over at least 5ms so the clock resolution doesn't matter
+	volatile float keep = 0;
+	auto timeRays = [&](bool shaded) {
+		uint64_t start = ofGetElapsedTimeMicros();
+		size_t traced = 0;
+		do {
+			for (const Ray& ray : rays) {
+				if (shaded) keep = keep + traceRay(ray).x;
+				else {
+					RayHit hit;
+					keep = keep + prims.intersect(ray, hit);
+				}
+			}
+			traced += rays.size();
+		} while (ofGetElapsedTimeMicros() - start < 5000);
+		return (ofGetElapsedTimeMicros() - start) * 1e-6 / traced;
+	};
+
+	RenderSettings saved = settings;
+	ShadeFn savedShade = shadeFn, savedBounce = bounceFn;
+	double count = (double)settings.width * settings.height * settings.samples;
+
+	RenderEstimate estimate;
+	uint64_t start = ofGetElapsedTimeMicros();
+	bakeOcclusion();
+	cacheIrradiance();
+	estimate.prepass = (ofGetElapsedTimeMicros() - start) * 1e-6;
+
+	estimate.visibility = timeRays(false) * count;
+	shadeFn = selectShade();
+	double tracing = timeRays(true) * count;
+	if (saved.shadows) {
+		settings.shadows = false;
+		shadeFn = selectShade();
+		bounceFn = selectBounce();
+		estimate.shadows = std::max(0.0, tracing - timeRays(true) * count);
+		settings = saved;
+		bounceFn = selectBounce();
+	}
+	if (saved.specular && !prims.lights.empty()) {
+		settings.specular = false;
+		shadeFn = selectShade();
+		estimate.specular = std::max(0.0, tracing - timeRays(true) * count);
+		settings = saved;
+	}
+	AmbientMode ambient = ambientMode();
+	if (ambient != AmbientNone) {
+		settings.environmentSamples = settings.irradianceSamples = settings.aoSamples = 0;
+		shadeFn = selectShade();
+		double cost = std::max(0.0, tracing - timeRays(true) * count);
+		if (ambient == AmbientEnvironment) estimate.environment = cost;
+		if (ambient == AmbientOcclusion) estimate.occlusion = cost;
+		if (ambient == AmbientIrradiance) estimate.indirect = cost;
+		settings = saved;
+	}
+	estimate.total = estimate.prepass + tracing;
+	shadeFn = savedShade;
+	bounceFn = savedBounce;
+	return estimate;
+}
 
-	return shaded;
+void ofApp::printEstimate() {
+	RenderEstimate estimate = estimateRender();
+	cout << fixed << setprecision(2) << "estimated render time " << estimate.total << "s ("
+		<< settings.width << "x" << settings.height << " x " << settings.samples << " samples): prepass " << estimate.prepass << "s, visibility " << estimate.visibility
+		<< "s, shadows " << estimate.shadows << "s, specular " << estimate.specular << "s";
+	AmbientMode ambient = ambientMode();
+	if (ambient == AmbientEnvironment) cout << ", environment " << estimate.environment << "s";
+	if (ambient == AmbientOcclusion) cout << ", ambient occlusion " << estimate.occlusion << "s";
+	if (ambient == AmbientIrradiance) cout << ", indirect light " << estimate.indirect << "s";
+	cout << defaultfloat << endl;
+	if (renderProcesses > 1) cout << "  split over " << renderProcesses << " processes" << endl;
 }
+
 //--------------------------------------------------------------
-void ofApp::draw() {
+//preview shaders - instances are placed in the vertex shader, so the
+//meshes are uploaded once and only the instance buffers change
+static const string previewSphereVert = R"(#version 330
+uniform mat4 modelViewProjectionMatrix;
+in vec4 position;
+in vec3 normal;
+in vec4 instanceA;          // center, radius
+in vec4 instanceColor;
+out vec3 worldPos;
+out vec3 worldNormal;
+out vec4 color;
+void main() {
+	worldPos = instanceA.xyz + position.xyz * instanceA.w;
+	worldNormal = normal;
+	color = instanceColor;
+	gl_Position = modelViewProjectionMatrix * vec4(worldPos, 1.0);
+}
+)";
+
+//planes are laid out like ofPlanePrimitive in Plane::draw(): a normal
+//along y spans x/z, anything else spans the plane around world up
+static const string previewPlaneVert = R"(#version 330
+uniform mat4 modelViewProjectionMatrix;
+in vec4 position;
+in vec4 instanceA;          // position, width
+in vec4 instanceB;          // normal, height
+in vec4 instanceColor;
+out vec3 worldPos;
+out vec3 worldNormal;
+out vec4 color;
+void main() {
+	vec3 n = instanceB.xyz;
+	vec3 u = abs(n.y) > 0.99 ? vec3(1.0, 0.0, 0.0) : normalize(cross(vec3(0.0, 1.0, 0.0), n));
+	vec3 v = cross(n, u);
+	worldPos = instanceA.xyz + u * position.x * instanceA.w + v * position.y * instanceB.w;
+	worldNormal = n;
+	color = instanceColor;
+	gl_Position = modelViewProjectionMatrix * vec4(worldPos, 1.0);
+}
+)";
+
+//same lighting model as ofApp::shade() (lambert, blinn-phong and the
+//spot light cone test), without shadows
+static const string previewFrag = R"(#version 330
+const int MAX_LIGHTS = 8;
+uniform vec4 lights[MAX_LIGHTS];        // position, intensity
+uniform float lightInvRange2[MAX_LIGHTS];
+uniform int lightCount;
+uniform vec4 spotLights[MAX_LIGHTS];    // position, intensity
+uniform vec4 spotDirs[MAX_LIGHTS];      // direction, cosine of the cone angle
+uniform float spotInvRange2[MAX_LIGHTS];
+uniform int spotLightCount;
+uniform vec3 eye;                       // render camera (for specular)
+uniform float power;
+uniform int specular;
+uniform vec3 specularColor;
+in vec3 worldPos;
+in vec3 worldNormal;
+in vec4 color;
+out vec4 fragColor;
+
+//see attenuation() in ofApp.h
+float attenuation(float intensity, float distance2, float invRange2) {
+	float x = min(distance2 * invRange2, 1.0);
+	float window = 1.0 - x * x;
+	return intensity / distance2 * window * window;
+}
 
-	ofSetDepthTest(true);
+void main() {
+	vec3 n = normalize(worldNormal);
+	vec3 shaded = vec3(0.0);
+	for (int i = 0; i < lightCount; i++) {
+		vec3 toLight = lights[i].xyz - worldPos;
+		vec3 l = normalize(toLight);
+		float irradiance = attenuation(lights[i].w, dot(toLight, toLight), lightInvRange2[i]);
+		shaded += color.rgb * irradiance * max(0.0, dot(n, l));
+		if (specular != 0) {
+			vec3 h = normalize(l + normalize(eye - worldPos));
+			shaded += specularColor * irradiance * pow(max(0.0, dot(n, h)), power);
+		}
+	}
+	for (int i = 0; i < spotLightCount; i++) {
+		vec3 toLight = spotLights[i].xyz - worldPos;
+		vec3 l = normalize(toLight);
+		if (dot(-l, spotDirs[i].xyz) >= spotDirs[i].w) {
+			float irradiance = attenuation(spotLights[i].w, dot(toLight, toLight), spotInvRange2[i]);
+			shaded += color.rgb * irradiance * max(0.0, dot(n, l));
+		}
+	}
+	fragColor = vec4(clamp(shaded, 0.0, 1.0), color.a);
+}
+)";
+
+static void setupPreviewShader(ofShader& shader, const string& vert) {
+	shader.setupShaderFromSource(GL_VERTEX_SHADER, vert);
+	shader.setupShaderFromSource(GL_FRAGMENT_SHADER, previewFrag);
+	shader.bindDefaults();
+	shader.bindAttribute(PreviewRenderer::instanceA, "instanceA");
+	shader.bindAttribute(PreviewRenderer::instanceB, "instanceB");
+	shader.bindAttribute(PreviewRenderer::instanceColor, "instanceColor");
+	if (!shader.linkProgram()) cout << "could not link preview shader" << endl;
+}
 
-	theCam->begin();
+static void bindInstances(ofVboMesh& mesh, ofBufferObject& buffer) {
+	int stride = 3 * sizeof(glm::vec4);
+	ofVbo& vbo = mesh.getVbo();
+	vbo.setAttributeBuffer(PreviewRenderer::instanceA, buffer, 4, stride, 0);
+	vbo.setAttributeBuffer(PreviewRenderer::instanceB, buffer, 4, stride, sizeof(glm::vec4));
+	vbo.setAttributeBuffer(PreviewRenderer::instanceColor, buffer, 4, stride, 2 * sizeof(glm::vec4));
+	vbo.setAttributeDivisor(PreviewRenderer::instanceA, 1);
+	vbo.setAttributeDivisor(PreviewRenderer::instanceB, 1);
+	vbo.setAttributeDivisor(PreviewRenderer::instanceColor, 1);
+}
 
-	scene.clear();
+void PreviewRenderer::setup() {
+	setupPreviewShader(sphereShader, previewSphereVert);
+	setupPreviewShader(planeShader, previewPlaneVert);
+
+	//every level is scaled by radius in the sphere shader, so the box
+	//proxy is exactly the sphere's bounds
+	sphereLods[Full].mesh = ofMesh::sphere(1, 16);
+	sphereLods[Coarse].mesh = ofMesh::sphere(1, 6);
+	sphereLods[Box].mesh = ofMesh::box(2, 2, 2, 1, 1, 1);
+	for (Lod& lod : sphereLods) {
+		lod.instances.allocate();
+		bindInstances(lod.mesh, lod.instances);
+	}
+	planeMesh = ofMesh::plane(1, 1, 2, 2);
+	planeInstances.allocate();
+	bindInstances(planeMesh, planeInstances);
+}
 
-	scene.push_back(new Plane(glm::vec3(0, -5, 0), glm::vec3(0, 1, 0), ofColor::green, 600, 400));				//ground plane
+//--------------------------------------------------------------
+//planes are uploaded once here, 3 vec4 per instance (instanceA,
+//instanceB, color); spheres are kept for per frame culling
+void PreviewRenderer::build(const ScenePrims& objects) {
+	spheres = objects.spheres;
+	sphereColors.clear();
+	for (const SpherePrim& s : spheres) sphereColors.push_back(glm::vec4(objects.diffuse[s.object], 1));
+
+	vector<glm::vec4> data;
+	for (const PlanePrim& pl : objects.planes) {
+		data.push_back(glm::vec4(pl.position, pl.width));
+		data.push_back(glm::vec4(pl.normal, pl.height));
+		data.push_back(glm::vec4(objects.diffuse[pl.object], 1));
+	}
+	planeCount = objects.planes.size();
+	if (planeCount > 0) planeInstances.setData(data, GL_STATIC_DRAW);
+}
 
-	scene.push_back(new Plane(glm::vec3(0, 0, -10), glm::vec3(0, 0, 1), ofColor::darkGrey, 600, 400));				//ground plane
+//--------------------------------------------------------------
+//lights as the tracer sees them (buildPrims() flattening), applied to
+//both shaders on the next draw
+void PreviewRenderer::setLighting(const ScenePrims& lighting, const glm::vec3& eye, float power, bool specular) {
+	lights.clear();
+	spotLights.clear();
+	spotDirs.clear();
+	lightInvRange2.clear();
+	spotInvRange2.clear();
+	for (const PointLightPrim& l : lighting.lights) {
+		if (lights.size() == maxLights) break;
+		lights.push_back(glm::vec4(l.position, l.intensity));
+		lightInvRange2.push_back(l.invRange2);
+	}
+	for (const SpotLightPrim& l : lighting.spotLights) {
+		if (spotLights.size() == maxLights) break;
+		spotLights.push_back(glm::vec4(l.position, l.intensity));
+		spotDirs.push_back(glm::vec4(l.direction, l.cosAngle));
+		spotInvRange2.push_back(l.invRange2);
+	}
+	this->eye = eye;
+	this->power = power;
+	this->specular = specular;
+}
 
-	//scene.push_back(new Sphere(glm::vec3(0, 1, -2), 1, ofColor::purple));											//purple sphere
+void PreviewRenderer::applyLighting(const ofShader& shader) const {
+	shader.setUniform4fv("lights", lights.empty() ? nullptr : &lights[0].x, lights.size());
+	shader.setUniform1fv("lightInvRange2", lightInvRange2.empty() ? nullptr : &lightInvRange2[0], lightInvRange2.size());
+	shader.setUniform1i("lightCount", lights.size());
+	shader.setUniform4fv("spotLights", spotLights.empty() ? nullptr : &spotLights[0].x, spotLights.size());
+	shader.setUniform4fv("spotDirs", spotDirs.empty() ? nullptr : &spotDirs[0].x, spotDirs.size());
+	shader.setUniform1fv("spotInvRange2", spotInvRange2.empty() ? nullptr : &spotInvRange2[0], spotInvRange2.size());
+	shader.setUniform1i("spotLightCount", spotLights.size());
+	shader.setUniform3f("eye", eye);
+	shader.setUniform1f("power", power);
+	shader.setUniform1i("specular", specular);
+	shader.setUniform3f("specularColor", toVec(ofColor::lightGray));
+}
 
-	//scene.push_back(new Sphere(glm::vec3(-1, 0, 1), 1, ofColor::blue));												//blue sphere
+//--------------------------------------------------------------
+//culls and buckets spheres by detail for this camera, then draws
+//each bucket and the planes with one call apiece
+void PreviewRenderer::draw(const ofCamera& cam) {
+	Frustum frustum(cam.getModelViewProjectionMatrix());
+	glm::vec3 eye = cam.getGlobalPosition();
+	float pixelsPerUnit = ofGetViewportHeight() / 2.0f / tan(glm::radians(cam.getFov()) / 2);
+
+	for (vector<glm::vec4>& data : lodData) data.clear();
+	for (size_t i = 0; i < spheres.size(); i++) {
+		const SpherePrim& s = spheres[i];
+		if (!frustum.visible(primBounds(s))) continue;
+		float distance = std::max(glm::distance(eye, s.center), s.radius);
+		float pixels = s.radius / distance * pixelsPerUnit;
+		int level = pixels > fullDetailPixels ? Full : pixels > boxPixels ? Coarse : Box;
+		lodData[level].push_back(glm::vec4(s.center, s.radius));
+		lodData[level].push_back(glm::vec4(0));
+		lodData[level].push_back(sphereColors[i]);
+	}
 
-	//scene.push_back(new Sphere(glm::vec3(.5, 0, 0), 1, ofColor::darkGreen));											//green sphere
+	sphereShader.begin();
+	applyLighting(sphereShader);
+	for (int level = 0; level < LodCount; level++) {
+		Lod& lod = sphereLods[level];
+		lod.count = lodData[level].size() / 3;
+		if (lod.count == 0) continue;
+		lod.instances.setData(lodData[level], GL_DYNAMIC_DRAW);
+		lod.mesh.drawInstanced(OF_MESH_FILL, lod.count);
+	}
+	sphereShader.end();
 
+	if (planeCount > 0) {
+		planeShader.begin();
+		applyLighting(planeShader);
+		planeMesh.drawInstanced(OF_MESH_FILL, planeCount);
+		planeShader.end();
+	}
+}
 
-	light.clear();
+//--------------------------------------------------------------
+//planes from the rows of the view projection matrix (Gribb/Hartmann)
+Frustum::Frustum(const glm::mat4& m) {
+	glm::vec4 row[4];
+	for (int i = 0; i < 4; i++) row[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+	for (int i = 0; i < 3; i++) {
+		planes[2 * i] = row[3] + row[i];
+		planes[2 * i + 1] = row[3] - row[i];
+	}
+}
 
-	//light.push_back(new Light(glm::vec3(100, 150, 150), .2));			//top right light
+//a box is outside if its corner furthest along some plane's normal is
+//still behind that plane
+bool Frustum::visible(const Bounds& b) const {
+	for (const glm::vec4& pl : planes) {
+		glm::vec3 corner(pl.x > 0 ? b.max.x : b.min.x, pl.y > 0 ? b.max.y : b.min.y, pl.z > 0 ? b.max.z : b.min.z);
+		if (glm::dot(glm::vec3(pl), corner) + pl.w < 0) return false;
+	}
+	return true;
+}
 
-	//light.push_back(new Light(glm::vec3(-20, 30, 45), .2));		//top left light
+//--------------------------------------------------------------
+void ofApp::draw() {
 
-	spotLights.clear();
+	ofSetDepthTest(true);
+
+	theCam->begin();
+
+	//only refresh picking and the preview when something was edited
+	if (sceneDirty) updateScene();
 
-	for (int i = 0; i < aimPoint.size(); i++) {
-		spotLights.push_back(new spotLight(spotLightPos[i], aimPoint[i], 2, angle[i]));
+	//draw all scene objects, batched per primitive type
+	if (previewDirty) {
+		preview.build(editPrims);
+		previewDirty = false;
 	}
 
-	//draw all scene objects
-	for (int i = 0; i < scene.size(); i++) {
-		ofColor color = scene[i]->diffuseColor;
-		ofSetColor(color);
-		scene[i]->draw();
+	//shaded by the current lights, the way the tracer would
+	ScenePrims lighting;
+	for (int i = 0; i < light.size(); i++) {
+		light[i]->setIntensity(intensity);
+		light[i]->setRange(lightRange);
+		light[i]->addPrims(lighting, i);
+	}
+	for (int i = 0; i < spotLights.size(); i++) {
+		spotLights[i]->setIntensity(spotLightIntensity);
+		spotLights[i]->setRange(lightRange);
+		spotLights[i]->addPrims(lighting, i);
 	}
+	preview.setLighting(lighting, renderCam.position, power, specular);
+	preview.draw(*theCam);
 
 
 	//draw all lights
 	for (int i = 0; i < light.size(); i++) {
-		light[i]->setIntensity(intensity);
 		light[i]->draw();
 	}
 
 	//draw all spotlights
 	for (int i = 0; i < spotLights.size(); i++) {
-		spotLights[i]->setIntensity(spotLightIntensity);
 		spotLights[i]->draw();
 	}
 
@@ -374,9 +2596,10 @@ void ofApp::draw() {
 	}
 
 	//draw render
-	if (drawImage) {
+	if (drawImage && image.isAllocated()) {
 		ofSetColor(ofColor::white);
-		image.draw(0, 0);
+		float scale = glm::min(1.0f, glm::min(ofGetWidth() / image.getWidth(), ofGetHeight() / image.getHeight()));
+		image.draw(0, 0, image.getWidth() * scale, image.getHeight() * scale);
 	}
 
 	if (renderdraw) {
@@ -415,6 +2638,19 @@ void ofApp::keyPressed(int key) {
 	case 'm':
 		renderdraw = true;
 		break;
+	case '1':
+	case '2':
+	case '3':
+		applyPreset(renderPresets[key - '1']);
+		captureSettings();
+		buildPrims();
+		printEstimate();
+		break;
+	case 'e':
+		captureSettings();
+		buildPrims();
+		printEstimate();
+		break;
 	default:
 		break;
 	}
@@ -434,57 +2670,41 @@ void ofApp::mouseMoved(int x, int y) {
 void ofApp::mouseDragged(int x, int y, int button) {
 	if (!mainCam.getMouseInputEnabled()) {
 
-		if (aimPointDrag) {
+		if (aimPointDrag || lightDrag) {
 			glm::vec3 screen3dpt = theCam->screenToWorld(glm::vec3(x, y, 0));
 			glm::vec3 rayOrigin = theCam->getPosition();
 			glm::vec3 rayDir = glm::normalize(screen3dpt - rayOrigin);
 			r = Ray(rayOrigin, rayDir);
-			p.intersect(r, glm::vec3(0), glm::vec3(0));
-
-			aimPoint[lightIndex] = p.getIntersectionPoint();
+			glm::vec3 point, normal;
+			p.intersect(r, point, normal);
 
-		}
-
-		else if (lightDrag) {
-			glm::vec3 screen3dpt = theCam->screenToWorld(glm::vec3(x, y, 0));
-			glm::vec3 rayOrigin = theCam->getPosition();
-			glm::vec3 rayDir = glm::normalize(screen3dpt - rayOrigin);
-			r = Ray(rayOrigin, rayDir);
-			p.intersect(r, glm::vec3(0), glm::vec3(0));
-
-			spotLightPos[lightIndex] = p.getIntersectionPoint();
+			if (aimPointDrag) spotLights[lightIndex]->setAimPoint(p.getIntersectionPoint());
+			else spotLights[lightIndex]->setPosition(p.getIntersectionPoint());
+			sceneDirty = true;
 		}
 	}
 }
 
 //--------------------------------------------------------------
+//selects the nearest light or aim point handle under the mouse
 void ofApp::mousePressed(int x, int y, int button) {
 	glm::vec3 screen3dpt = theCam->screenToWorld(glm::vec3(x, y, 0));
 	glm::vec3 rayOrigin = theCam->getPosition();
 	glm::vec3 rayDir = glm::normalize(screen3dpt - rayOrigin);
-	bool aimPointSelect = false;
-	bool lightSelect = false;
-
 
 	r = Ray(rayOrigin, rayDir);
-	glm::vec3 point, normal;
-	for (int i = 0; i < spotLights.size(); i++) {
-		aimPointSelect = glm::intersectRaySphere(r.p, r.d, spotLights[i]->aimPoint, spotLights[i]->coneAngle, point, normal);
-		if (aimPointSelect) {
-			planeNormal = glm::normalize(mainCam.getPosition() - screen3dpt);
-			p = Plane(aimPoint[i], planeNormal, ofColor::grey, 20,20);
-			lightIndex = i;
-			aimPointDrag = true;
-		}
-
-
-		lightSelect = glm::intersectRaySphere(r.p, r.d, spotLights[i]->position, spotLights[i]->coneHeight/5, point, normal);
-		if (lightSelect && !aimPointSelect) {
-			planeNormal = glm::normalize(mainCam.getPosition() - spotLightPos[i]);
-			p = Plane(spotLightPos[i], planeNormal, ofColor::grey, 20, 20);
-			lightIndex = i;
-			lightDrag = true;
-		}
+	PickHandle handle = pick(r);
+	if (handle.kind == PickHandle::AimPoint) {
+		planeNormal = glm::normalize(mainCam.getPosition() - screen3dpt);
+		p = Plane(spotLights[handle.index]->aimPoint, planeNormal, ofColor::grey, 20, 20);
+		lightIndex = handle.index;
+		aimPointDrag = true;
+	}
+	else if (handle.kind == PickHandle::Light) {
+		planeNormal = glm::normalize(mainCam.getPosition() - spotLights[handle.index]->position);
+		p = Plane(spotLights[handle.index]->position, planeNormal, ofColor::grey, 20, 20);
+		lightIndex = handle.index;
+		lightDrag = true;
 	}
 }
 
@@ -515,6 +2735,9 @@ void ofApp::gotMessage(ofMessage msg) {
 }
 
 //--------------------------------------------------------------
+//environment maps can be dropped on the window
 void ofApp::dragEvent(ofDragInfo dragInfo) {
-
+	for (const string& file : dragInfo.files) {
+		if (environment.load(file)) cout << "environment map " << file << " (" << environment.width << "x" << environment.height << ")" << endl;
+	}
 }
@@ -12,7 +12,8 @@
 //  from the view plane.  The viewplane can be also resized.  When ray tracing an image, the aspect
 //  ratio of the view plane should the be same as your image. So for example, the current view plane
 //  default size is ( 6.0 width by 4.0 height ).   A 1200x800 pixel image would have the same
-//  aspect ratio.
+//  aspect ratio.  Renders call RenderCam::setFov() with the output size, so the view plane
+//  always follows the render resolution and field of view.
 //
 //  This is not a complete ray tracer - just a set of skelton classes to start.  The current
 //  base scene object only stores a value for the diffuse/specular color of the object (defaut is gray).
@@ -32,15 +33,967 @@
 //
 class Ray {
 public:
-	Ray(glm::vec3 p, glm::vec3 d) { this->p = p; this->d = d; }
+	Ray(glm::vec3 p, glm::vec3 d, float time = 0) { this->p = p; this->d = d; this->time = time; }
 	Ray() {}
 	void draw(float t) { ofDrawLine(p, p + t * d); }
 
-	glm::vec3 evalPoint(float t) {
+	glm::vec3 evalPoint(float t) const {
 		return (p + t * d);
 	}
 
 	glm::vec3 p, d;
+	float time = 0;             // in [0, 1] over a frame, moving prims are tested where they are at this time
+};
+
+//  Arena allocator - objects are bump allocated out of large blocks so that
+//  a whole scene sits in a few contiguous chunks of memory.  Everything is
+//  released in one shot with reset() (destructors run in reverse order of
+//  creation); the blocks themselves are kept around for the next scene.
+//
+class Arena {
+public:
+	struct Marker {
+		size_t block = 0;
+		size_t used = 0;
+		size_t dtorCount = 0;
+	};
+
+	Arena(size_t blockSize = 64 * 1024) { this->blockSize = blockSize; }
+	~Arena() { reset(); for (Block& b : blocks) ::operator delete(b.data); }
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	void* allocate(size_t size, size_t align);
+
+	// construct an object in the arena - it lives until the next reset()/rewind()
+	//
+	template<class T, class... Args> T* create(Args&&... args) {
+		T* obj = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		if (!std::is_trivially_destructible<T>::value)
+			dtors.push_back(Dtor{ [](void* p) { static_cast<T*>(p)->~T(); }, obj });
+		return obj;
+	}
+
+	// uninitialized storage for n trivially destructible values (scratch buffers)
+	//
+	template<class T> T* allocArray(size_t n) {
+		static_assert(std::is_trivially_destructible<T>::value, "arena arrays are never destroyed");
+		return static_cast<T*>(allocate(sizeof(T) * n, alignof(T)));
+	}
+
+	Marker mark() const;
+	void rewind(const Marker& m);
+	void reset() { rewind(Marker()); }
+	size_t bytesUsed() const;
+
+private:
+	struct Block {
+		char* data;
+		size_t size;
+		size_t used;
+	};
+	struct Dtor {
+		void(*fn)(void*);
+		void* obj;
+	};
+
+	vector<Block> blocks;
+	vector<Dtor> dtors;
+	size_t current = 0;
+	size_t blockSize;
+};
+
+//  Rewinds an arena to where it was when the scope was entered.  Used with
+//  scratchArena() for temporaries that only live for part of a render.
+//
+class ArenaScope {
+public:
+	ArenaScope(Arena& a) : arena(a) { m = a.mark(); }
+	~ArenaScope() { arena.rewind(m); }
+	Arena& arena;
+	Arena::Marker m;
+};
+
+//  per-thread scratch arena for render-time temporaries
+//
+Arena& scratchArena();
+
+//  Closest hit found by the tracer
+//
+struct RayHit {
+	float t = FLT_MAX;
+	glm::vec3 normal;
+	int object = -1;            // index into ofApp::scene
+};
+
+//  Flat copies of the scene geometry, one array per primitive type.  The
+//  tracer only ever intersects these, so every test is a plain inlined
+//  function instead of a virtual SceneObject::intersect call.
+//
+//  Prims move in a straight line over a frame: motion is the offset at
+//  time 1, zero for anything static.
+//
+struct SpherePrim {
+	glm::vec3 center;
+	float radius;
+	int object;
+	glm::vec3 motion = glm::vec3(0);
+
+	glm::vec3 centerAt(float time) const { return center + time * motion; }
+};
+
+struct PlanePrim {
+	glm::vec3 position;
+	glm::vec3 normal;
+	float width, height;
+	int object;
+	glm::vec3 motion = glm::vec3(0);
+};
+
+//  Ray must have a normalized direction
+//
+inline bool intersectPrim(const SpherePrim& s, const Ray& ray, float& t) {
+	glm::vec3 oc = s.centerAt(ray.time) - ray.p;
+	float tc = glm::dot(oc, ray.d);
+	float d2 = glm::dot(oc, oc) - tc * tc;
+	float r2 = s.radius * s.radius;
+	if (d2 > r2) return false;
+	float th = sqrt(r2 - d2);
+	t = (tc - th > 1e-4f) ? tc - th : tc + th;
+	return t > 1e-4f;
+}
+
+//  same bounds test as Plane::intersect (x/z extent around position)
+//
+inline bool intersectPrim(const PlanePrim& pl, const Ray& ray, float& t) {
+	float denom = glm::dot(ray.d, pl.normal);
+	if (fabs(denom) < 1e-7f) return false;
+	glm::vec3 position = pl.position + ray.time * pl.motion;
+	t = glm::dot(position - ray.p, pl.normal) / denom;
+	if (t <= 1e-4f) return false;
+	glm::vec3 point = ray.p + t * ray.d;
+	return (fabs(point.x - position.x) < pl.width / 2 && fabs(point.z - position.z) < pl.height / 2);
+}
+
+inline glm::vec3 primNormal(const SpherePrim& s, const Ray& ray, float t) { return (ray.evalPoint(t) - s.centerAt(ray.time)) / s.radius; }
+inline glm::vec3 primNormal(const PlanePrim& pl, const Ray& ray, float t) { return pl.normal; }
+
+//  closest hit over one primitive array - statically dispatched on Prim
+//
+template<class Prim> inline void intersectAll(const vector<Prim>& prims, const Ray& ray, RayHit& hit) {
+	const Prim* closest = nullptr;
+	for (const Prim& prim : prims) {
+		float t;
+		if (intersectPrim(prim, ray, t) && t < hit.t) {
+			hit.t = t;
+			closest = &prim;
+		}
+	}
+	if (closest) {
+		hit.object = closest->object;
+		hit.normal = primNormal(*closest, ray, hit.t);
+	}
+}
+
+//  true if anything in the array is hit before maxT
+//
+template<class Prim> inline bool occludedAny(const vector<Prim>& prims, const Ray& ray, float maxT) {
+	for (const Prim& prim : prims) {
+		float t;
+		if (intersectPrim(prim, ray, t) && t < maxT) return true;
+	}
+	return false;
+}
+
+//  Axis aligned bounding box
+//
+struct Bounds {
+	glm::vec3 min = glm::vec3(FLT_MAX);
+	glm::vec3 max = glm::vec3(-FLT_MAX);
+
+	void grow(const Bounds& b) { min = glm::min(min, b.min); max = glm::max(max, b.max); }
+	void grow(const glm::vec3& p) { min = glm::min(min, p); max = glm::max(max, p); }
+	glm::vec3 center() const { return (min + max) * 0.5f; }
+	Bounds lerp(const Bounds& end, float time) const {
+		Bounds b;
+		b.min = glm::mix(min, end.min, time);
+		b.max = glm::mix(max, end.max, time);
+		return b;
+	}
+
+	// slab test against [0, maxT), invDir is 1 / ray.d
+	bool hit(const Ray& ray, const glm::vec3& invDir, float maxT) const {
+		glm::vec3 t0 = (min - ray.p) * invDir;
+		glm::vec3 t1 = (max - ray.p) * invDir;
+		glm::vec3 tNear = glm::min(t0, t1), tFar = glm::max(t0, t1);
+		float enter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+		float exit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, maxT));
+		return enter <= exit;
+	}
+};
+
+//  bounds at one time in [0, 1] of the frame
+inline Bounds primBounds(const SpherePrim& s, float time = 0) {
+	Bounds b;
+	b.min = s.centerAt(time) - glm::vec3(s.radius);
+	b.max = s.centerAt(time) + glm::vec3(s.radius);
+	return b;
+}
+
+//  Bounding volume hierarchy over one primitive array.  build() reorders
+//  the array so every node covers a contiguous range of it; nodes are
+//  stored depth first, so a node's left child always follows it.  Used by
+//  the tracer and by mouse picking.  With moving prims every node also
+//  keeps its bounds at the end of the frame and rays test the box interpolated
+//  to their time, which stays as tight as the prims themselves instead of
+//  covering the whole swept volume.
+//
+template<class Prim> class Bvh {
+public:
+	struct Node {
+		Bounds bounds;
+		Bounds endBounds;       // at time 1, only used when moving
+		int start, count;       // leaf: range of prims, inner: count == 0
+		int right;              // inner: index of the right child
+	};
+
+	void build(vector<Prim>& prims) {
+		nodes.clear();
+		moving = false;
+		if (!prims.empty()) build(prims, 0, (int)prims.size());
+	}
+
+	void intersect(const vector<Prim>& prims, const Ray& ray, RayHit& hit) const {
+		if (nodes.empty()) return;
+		glm::vec3 invDir = 1.0f / ray.d;
+		const Prim* closest = nullptr;
+		int stack[64];
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0) {
+			int index = stack[--top];
+			const Node& node = nodes[index];
+			if (!nodeHit(node, ray, invDir, hit.t)) continue;
+			if (node.count == 0) {
+				stack[top++] = node.right;
+				stack[top++] = index + 1;
+				continue;
+			}
+			for (int i = node.start; i < node.start + node.count; i++) {
+				float t;
+				if (intersectPrim(prims[i], ray, t) && t < hit.t) {
+					hit.t = t;
+					closest = &prims[i];
+				}
+			}
+		}
+		if (closest) {
+			hit.object = closest->object;
+			hit.normal = primNormal(*closest, ray, hit.t);
+		}
+	}
+
+	bool occluded(const vector<Prim>& prims, const Ray& ray, float maxT) const {
+		if (nodes.empty()) return false;
+		glm::vec3 invDir = 1.0f / ray.d;
+		int stack[64];
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0) {
+			int index = stack[--top];
+			const Node& node = nodes[index];
+			if (!nodeHit(node, ray, invDir, maxT)) continue;
+			if (node.count == 0) {
+				stack[top++] = node.right;
+				stack[top++] = index + 1;
+				continue;
+			}
+			for (int i = node.start; i < node.start + node.count; i++) {
+				float t;
+				if (intersectPrim(prims[i], ray, t) && t < maxT) return true;
+			}
+		}
+		return false;
+	}
+
+	vector<Node> nodes;
+	bool moving = false;        // any prim has motion
+	static const int leafSize = 4;
+
+private:
+	bool nodeHit(const Node& node, const Ray& ray, const glm::vec3& invDir, float maxT) const {
+		if (!moving) return node.bounds.hit(ray, invDir, maxT);
+		return node.bounds.lerp(node.endBounds, ray.time).hit(ray, invDir, maxT);
+	}
+
+	// median split on the longest axis of the centroids (mid frame) -
+	// depth stays around log2(n / leafSize), well inside the traversal stack
+	void build(vector<Prim>& prims, int start, int end) {
+		int index = (int)nodes.size();
+		nodes.push_back(Node());
+		Bounds bounds, endBounds, centers;
+		for (int i = start; i < end; i++) {
+			Bounds b = primBounds(prims[i], 0), e = primBounds(prims[i], 1);
+			bounds.grow(b);
+			endBounds.grow(e);
+			centers.grow((b.center() + e.center()) * 0.5f);
+			if (b.min != e.min) moving = true;
+		}
+		nodes[index].bounds = bounds;
+		nodes[index].endBounds = endBounds;
+		if (end - start <= leafSize) {
+			nodes[index].start = start;
+			nodes[index].count = end - start;
+			return;
+		}
+		glm::vec3 extent = centers.max - centers.min;
+		int axis = (extent.y > extent.x) ? 1 : 0;
+		if (extent.z > extent[axis]) axis = 2;
+		int mid = (start + end) / 2;
+		std::nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end,
+			[axis](const Prim& a, const Prim& b) { return primBounds(a, .5f).center()[axis] < primBounds(b, .5f).center()[axis]; });
+		nodes[index].start = start;
+		nodes[index].count = 0;
+		build(prims, start, mid);
+		nodes[index].right = (int)nodes.size();
+		build(prims, mid, end);
+	}
+};
+
+//  Lights flattened the same way, so shading never needs a virtual call
+//  or a copy of a Light object
+//
+//  lights move like the prims above, spot lights keep their direction
+//
+struct PointLightPrim {
+	glm::vec3 position;
+	float intensity;
+	glm::vec3 motion = glm::vec3(0);
+	float invRange2 = 0;        // 1 / range², 0 when the light reaches everywhere
+};
+
+struct SpotLightPrim {
+	glm::vec3 position;
+	glm::vec3 direction;        // unit, towards the aim point
+	float intensity;
+	float cosAngle;             // points within the cone have dot(toPoint, direction) >= cosAngle
+	glm::vec3 motion = glm::vec3(0);
+	float invRange2 = 0;
+};
+
+//  1 / range² for the prims above, range 0 is unlimited
+inline float invRange2(float range) { return (range > 0) ? 1 / (range * range) : 0; }
+
+//  light arriving at distance² from a light: inverse square falloff,
+//  faded to zero at the light's range so the cutoff leaves no edge.
+//  Callers skip the light entirely once distance2 * invRange2 >= 1.
+//
+inline float attenuation(float intensity, float distance2, float invRange2) {
+	float x = distance2 * invRange2;
+	float window = 1 - x * x;
+	return intensity / distance2 * window * window;
+}
+
+//  Uniform grid over the lights that have a range.  Every cell lists the
+//  lights whose range reaches into it, so shading a point only visits
+//  its cell's lights plus the unbounded ones.  Cells are about as big as
+//  the average range.  Works for either light prim type.
+//
+class LightGrid {
+public:
+	struct Range {
+		const int* begin;
+		const int* end;
+	};
+
+	template<class Light> void build(const vector<Light>& lights);
+	void clear() { unbounded.clear(); cellStart.clear(); indices.clear(); }
+
+	// bounded lights that can reach p, in index order
+	Range lightsAt(const glm::vec3& p) const {
+		if (cellStart.empty()) return Range{ nullptr, nullptr };
+		glm::vec3 c = (p - bounds.min) * invCellSize;
+		if (c.x < 0 || c.y < 0 || c.z < 0 || c.x >= dims.x || c.y >= dims.y || c.z >= dims.z) return Range{ nullptr, nullptr };
+		int cell = ((int)c.z * dims.y + (int)c.y) * dims.x + (int)c.x;
+		return Range{ indices.data() + cellStart[cell], indices.data() + cellStart[cell + 1] };
+	}
+
+	vector<int> unbounded;      // lights without a range reach every point
+	Bounds bounds;              // of every bounded light's reach, nothing outside is lit by them
+	glm::ivec3 dims;
+	glm::vec3 invCellSize;
+	vector<int> cellStart;      // cell i lists indices[cellStart[i], cellStart[i + 1])
+	vector<int> indices;
+	static const int maxDim = 32;
+
+private:
+	glm::ivec3 cellOf(const glm::vec3& p) const {
+		return glm::clamp(glm::ivec3((p - bounds.min) * invCellSize), glm::ivec3(0), dims - 1);
+	}
+};
+
+//  box around everything a light reaches over the frame
+template<class Light> inline Bounds reachBounds(const Light& light) {
+	glm::vec3 r(1 / sqrt(light.invRange2));
+	Bounds b;
+	b.grow(light.position - r);
+	b.grow(light.position + r);
+	b.grow(light.position + light.motion - r);
+	b.grow(light.position + light.motion + r);
+	return b;
+}
+
+//  lights are binned twice: once to count each cell's lights, then into
+//  one flat array ordered by cell.  A still light only goes into cells
+//  its range sphere touches, a moving one into every cell of its box.
+template<class Light> void LightGrid::build(const vector<Light>& lights) {
+	clear();
+	bounds = Bounds();
+	vector<int> bounded;
+	float rangeSum = 0;
+	for (int i = 0; i < (int)lights.size(); i++) {
+		if (lights[i].invRange2 <= 0) {
+			unbounded.push_back(i);
+			continue;
+		}
+		bounded.push_back(i);
+		rangeSum += 1 / sqrt(lights[i].invRange2);
+		bounds.grow(reachBounds(lights[i]));
+	}
+	if (bounded.empty()) return;
+
+	glm::vec3 extent = bounds.max - bounds.min;
+	glm::vec3 cells = glm::ceil(extent / (rangeSum / bounded.size()));
+	dims = glm::clamp(glm::ivec3(cells), glm::ivec3(1), glm::ivec3(maxDim));
+	invCellSize = glm::vec3(dims) / extent;
+	glm::vec3 cellSize = extent / glm::vec3(dims);
+
+	vector<glm::ivec2> binned;  // (cell, light)
+	for (int i : bounded) {
+		const Light& light = lights[i];
+		Bounds reach = reachBounds(light);
+		glm::ivec3 lo = cellOf(reach.min), hi = cellOf(reach.max);
+		bool moving = light.motion != glm::vec3(0);
+		for (int z = lo.z; z <= hi.z; z++) {
+			for (int y = lo.y; y <= hi.y; y++) {
+				for (int x = lo.x; x <= hi.x; x++) {
+					glm::vec3 cellMin = bounds.min + glm::vec3(x, y, z) * cellSize;
+					glm::vec3 nearest = glm::clamp(light.position, cellMin, cellMin + cellSize);
+					glm::vec3 d = nearest - light.position;
+					if (!moving && glm::dot(d, d) * light.invRange2 >= 1) continue;
+					binned.push_back(glm::ivec2((z * dims.y + y) * dims.x + x, i));
+				}
+			}
+		}
+	}
+
+	cellStart.assign(dims.x * dims.y * dims.z + 1, 0);
+	for (const glm::ivec2& b : binned) cellStart[b.x + 1]++;
+	for (size_t c = 1; c < cellStart.size(); c++) cellStart[c] += cellStart[c - 1];
+	indices.resize(binned.size());
+	vector<int> next(cellStart.begin(), cellStart.end() - 1);
+	for (const glm::ivec2& b : binned) indices[next[b.x]++] = b.y;
+}
+
+class ScenePrims {
+public:
+	void clear() { spheres.clear(); planes.clear(); lights.clear(); spotLights.clear(); diffuse.clear(); sphereBvh.nodes.clear(); lightGrid.clear(); spotLightGrid.clear(); }
+	void buildAccel() { sphereBvh.build(spheres); lightGrid.build(lights); spotLightGrid.build(spotLights); }
+	bool intersect(const Ray& ray, RayHit& hit) const;
+	bool occluded(const Ray& ray, float maxT) const;
+
+	// plain text snapshot, enough to render without the SceneObjects
+	void write(ostream& out) const;
+	bool read(istream& in);
+
+	vector<SpherePrim> spheres;
+	vector<PlanePrim> planes;   // few and scene sized, tested linearly
+	Bvh<SpherePrim> sphereBvh;  // rebuilt by buildAccel() whenever spheres change
+	vector<PointLightPrim> lights;
+	vector<SpotLightPrim> spotLights;
+	LightGrid lightGrid, spotLightGrid;  // rebuilt by buildAccel() with the lights
+	vector<glm::vec3> diffuse;  // per scene object, indexed by RayHit::object
+};
+
+//  colors are shaded as floats in [0, 1] and only quantized for output
+//
+inline glm::vec3 toVec(const ofColor& c) { return glm::vec3(c.r, c.g, c.b) / 255.0f; }
+inline ofColor toColor(const glm::vec3& c) {
+	glm::vec3 v = glm::clamp(c, 0.0f, 1.0f) * 255.0f;
+	return ofColor(v.x, v.y, v.z);
+}
+
+//  Everything a render depends on besides the scene itself.  Captured from
+//  the GUI once at the start of a render so the inner loops never read the
+//  sliders.
+//
+struct RenderSettings {
+	int width = 1200;
+	int height = 800;
+	int tileSize = 64;
+	float fov = 11.421186;      // vertical field of view in degrees (matches the old fixed 6x4 view plane)
+	float power = 100;          // phong exponent
+	float intensity = 100;      // applied to every point light, falls off with 1 / distance²
+	float spotLightIntensity = 700;
+	float lightRange = 0;       // applied to every light, no light reaches further (0 = unlimited)
+	bool shadows = true;
+	bool specular = true;
+	int samples = 1;            // rays per pixel (see samplePosition()), the most per pixel when adaptive
+	float adaptiveThreshold = 0; // > 0 stops sampling a pixel once its PixelStats::error() is below this
+	float shutter = .5;         // share of the frame the shutter is open for, 0 freezes motion
+	float environmentIntensity = 1;  // scales the environment map's radiance
+	int environmentSamples = 16; // directions sampled from the environment per shading point
+	int aoSamples = 0;          // ambient occlusion rays per shading point (AoCache::bakeScale times that per texel when baked), 0 = no ambient term (unused with an environment map or indirect light)
+	float aoDistance = 5;       // only geometry this close occludes
+	float aoIntensity = .3;     // ambient light, scaled by the unoccluded share
+	bool aoBake = true;         // look occlusion up in ofApp::aoCache instead of casting per point
+	int irradianceSamples = 0;  // rays per irradiance cache record, 0 = no indirect light (unused with an environment map)
+	float irradianceError = .3; // how far a record is trusted (Ward's a), smaller places more records
+
+	void write(ostream& out) const;
+	bool read(istream& in);
+};
+
+//  How much of the sample budget each part of the image gets: a coarse
+//  grid of weights in (0, 1] over the image, row 0 at the top.  Empty
+//  means every pixel is treated the same.  Built around a focus point
+//  (foveated - full density inside the radius, falling off with the
+//  square of the distance outside) or from a grayscale mask image.
+//
+class SampleDensity {
+public:
+	void clear() { weights.clear(); width = height = 0; }
+	bool empty() const { return weights.empty(); }
+	void setFovea(const glm::vec2& focus, float radius, float aspect);
+	bool loadMask(const string& path);
+
+	// u, v in [0, 1] across and down the image
+	float at(float u, float v) const {
+		if (empty()) return 1;
+		int x = glm::clamp((int)(u * width), 0, width - 1);
+		int y = glm::clamp((int)(v * height), 0, height - 1);
+		return weights[y * width + x];
+	}
+	// share of n samples for a pixel with this density, at least one
+	static int scale(int n, float density) { return std::max(1, (int)(n * density + .5f)); }
+
+	void write(ostream& out) const;
+	bool read(istream& in);
+
+	vector<float> weights;
+	int width = 0, height = 0;
+	float minimum = .05;        // the periphery never gets less than this
+	static const int gridSize = 64;
+};
+
+//  HDR environment in an equirectangular (latitude/longitude) image, seen
+//  by rays that miss the scene and lighting it from every direction.
+//  load() tabulates the pixels' luminance (times sin theta, the solid
+//  angle of their row) into a cdf per row plus one over the rows, so
+//  sample() picks directions in proportion to the light coming from them.
+//
+class EnvironmentMap {
+public:
+	bool load(const string& path);
+	void clear() { radiance.clear(); cdf.clear(); rowCdf.clear(); width = height = 0; path.clear(); hash.clear(); }
+	bool empty() const { return radiance.empty(); }
+
+	// radiance arriving from direction d (unit), black without a map
+	glm::vec3 lookup(const glm::vec3& d) const;
+	// direction for u in [0, 1)², pdf is per solid angle (0 if unusable)
+	glm::vec3 sample(const glm::vec2& u, float& pdf) const;
+
+	string path;                // image the map was loaded from (the snapshot carries this and hash)
+	string hash;                // of the pixels, so snapshots change when the file does
+	vector<glm::vec3> radiance; // row 0 is straight up
+	int width = 0, height = 0;
+	vector<float> cdf;          // per row, width + 1 entries from 0 to 1
+	vector<float> rowCdf;       // height + 1 entries from 0 to 1
+};
+
+//  Ambient occlusion baked over the surface of every object, so renders
+//  of an unchanged scene look it up instead of casting rays.  Spheres get
+//  a latitude/longitude grid, planes a grid of width x height around
+//  their position.  Texels aim for a quarter of the occlusion distance
+//  apart, but no map has more than maxTexels a side, so large planes get
+//  coarser ones (a 600 wide plane about 2.3 units).  Each texel casts
+//  bakeScale times the live ray count, as lookups don't average out noise
+//  the way live rays over many pixels do.  bake() only redoes the work
+//  when the geometry, distance or ray count changed, and bakes nothing
+//  for scenes with motion (those are always cast live).
+//
+class AoCache {
+public:
+	struct Map {
+		bool sphere = false;
+		glm::vec3 center;           // sphere center or plane position
+		glm::vec3 axisU, axisV;     // plane: unit directions of the grid
+		glm::vec2 size;             // plane: width, height
+		int width = 0, height = 0;  // 0 when the object isn't baked
+		vector<float> values;       // unoccluded share of the hemisphere per texel
+
+		glm::vec2 uv(const glm::vec3& p) const;
+		glm::vec3 texelPoint(int x, int y, glm::vec3& normal) const;
+	};
+
+	void bake(const ScenePrims& prims, float distance, int samples);
+	void clear() { maps.clear(); key.clear(); }
+	bool baked(int object) const { return object >= 0 && object < (int)maps.size() && maps[object].width > 0; }
+	// bilinear between texel centers, object must be baked()
+	float at(int object, const glm::vec3& p) const;
+
+	// unoccluded share of the cosine weighted hemisphere around norm,
+	// from n rays of the given length
+	static float cast(const ScenePrims& prims, const glm::vec3& p, const glm::vec3& norm, float time, int n, float distance);
+
+	vector<Map> maps;           // indexed by RayHit::object
+	string key;                 // hash of the geometry, distance and rays the maps were baked for
+	static const int bakeScale = 8;    // rays per texel for each live ray per shading point
+	static const int maxTexels = 256;  // per side
+};
+
+//  Indirect diffuse light (one bounce) computed at sparse points and
+//  interpolated in between (Ward's irradiance caching).  A record holds
+//  the mean radiance over the cosine weighted hemisphere around its
+//  normal and is trusted out to error x radius, the harmonic mean
+//  distance to what its rays hit, so records crowd into corners and
+//  spread out over open surfaces.  Records live in an octree, each in the
+//  smallest node at least as large as its reach, so lookup() only visits
+//  nodes whose records could cover the point.
+//
+class IrradianceCache {
+public:
+	struct Record {
+		glm::vec3 position, normal;
+		glm::vec3 irradiance;
+		float radius;
+	};
+
+	void clear() { records.clear(); nodes.clear(); key.clear(); }
+	bool empty() const { return records.empty(); }
+	// starts an empty octree over bounds; records outside stay in the root
+	void reset(const Bounds& bounds, float error);
+	void insert(const Record& record);
+	// weighted mean of the records valid at p, false if none is
+	bool lookup(const glm::vec3& p, const glm::vec3& norm, glm::vec3& irradiance) const;
+
+	struct Node {
+		glm::vec3 center;
+		float half;                 // half the side of the cube
+		int children = -1;          // first of 8 consecutive nodes, -1 for a leaf
+		vector<int> records;        // into records
+	};
+	vector<Record> records;
+	vector<Node> nodes;         // 0 is the root
+	string key;                 // ofApp::irradianceKey() the records were computed for
+	float error = .3;
+	float minRadius = .25, maxRadius = 10;  // clamp on Record::radius, in scene units
+};
+
+//  Named starting points for the render settings.  Resolution is a
+//  fraction of the full image size (ofApp::imageWidth/imageHeight).
+//  There's no recursion (reflection/refraction) in the tracer yet, so
+//  presets don't carry a depth.
+//
+struct RenderPreset {
+	const char* name;
+	float scale;
+	int samples;
+	bool shadows;
+	bool specular;
+};
+
+static const RenderPreset renderPresets[] = {
+	{ "draft", .25, 1, false, false },
+	{ "preview", .5, 1, true, true },
+	{ "final", 1, 4, true, true },
+};
+
+//  Render time extrapolated from a few hundred sample rays, in seconds
+//  for one process.  The feature costs are what switching each one off
+//  would save.
+//
+struct RenderEstimate {
+	double total = 0;
+	double prepass = 0;         // occlusion bake and irradiance cache, measured rather than extrapolated
+	double visibility = 0;      // finding the closest hit, no shading
+	double shadows = 0;
+	double specular = 0;
+	double environment = 0;     // only one of these three is used by a render
+	double occlusion = 0;
+	double indirect = 0;
+};
+
+//  Rectangle of pixels rendered as one unit of work
+//
+struct RenderTile {
+	int x, y, w, h;
+};
+
+vector<RenderTile> makeTiles(int width, int height, int tileSize);
+
+//  position of the i'th sample inside a pixel, in [0, 1).  Sample 0 is
+//  the pixel center, the rest follow a Halton (2, 3) sequence, so any
+//  run of consecutive samples stays well spread and passes can add more.
+//
+inline float halton(int i, int base) {
+	float f = 1, r = 0;
+	for (; i > 0; i /= base) {
+		f /= base;
+		r += f * (i % base);
+	}
+	return r;
+}
+inline glm::vec2 samplePosition(int i) {
+	return (i == 0) ? glm::vec2(.5) : glm::vec2(halton(i, 2), halton(i, 3));
+}
+
+//  time of sample i as a share of the open shutter.  Sample 0 is mid
+//  shutter, the rest follow Halton base 11, again to stay uncorrelated
+//  with the pixel and lens positions.  With a shift (per pixel, see
+//  pixelShift()) every sample follows the shifted sequence, so pixels
+//  don't all see the scene at the same few times.
+//
+inline float sampleTime(int i) {
+	return (i == 0) ? .5f : halton(i, 11);
+}
+inline float sampleTime(int i, float shift) {
+	return glm::fract(halton(i, 11) + shift);
+}
+
+//  Shirley's concentric mapping of u in [0, 1)² onto the unit disk
+//
+inline glm::vec2 concentricDisk(const glm::vec2& u) {
+	glm::vec2 p = u * 2.0f - 1.0f;
+	if (p.x == 0 && p.y == 0) return p;
+	float r, theta;
+	if (fabs(p.x) > fabs(p.y)) {
+		r = p.x;
+		theta = (PI / 4) * (p.y / p.x);
+	}
+	else {
+		r = p.y;
+		theta = (PI / 2) - (PI / 4) * (p.x / p.y);
+	}
+	return r * glm::vec2(cos(theta), sin(theta));
+}
+
+//  offset in [0, 1)² hashed from a pixel (and a salt, so one pixel can
+//  have several unrelated ones).  Shifting the lens and shutter sequences
+//  by it gives every pixel its own points, so few samples show up as
+//  noise instead of the same handful of images laid over each other.
+//
+inline glm::vec2 pixelShift(int x, int y, uint32_t salt) {
+	uint32_t hash = salt * 0x9e3779b9u;
+	for (uint32_t b : { (uint32_t)x, (uint32_t)y }) {
+		hash = (hash ^ b) * 0x85ebca6bu;
+		hash ^= hash >> 13;
+	}
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+	return glm::vec2((hash & 0xffff) / 65536.0f, (hash >> 16) / 65536.0f);
+}
+
+//  point on the unit disk for lens sample i: a Halton (5, 7) point, so
+//  lens positions don't correlate with the pixel positions, shifted by
+//  the pixel's pixelShift()
+//
+inline glm::vec2 lensSample(int i, const glm::vec2& shift) {
+	return concentricDisk(glm::fract(glm::vec2(halton(i, 5), halton(i, 7)) + shift));
+}
+
+//  cosine weighted direction in the hemisphere around unit normal n
+//
+inline glm::vec3 cosineDirection(const glm::vec3& n, const glm::vec2& u) {
+	glm::vec2 d = concentricDisk(u);
+	glm::vec3 t = glm::normalize(glm::cross(fabs(n.x) > .5f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0), n));
+	glm::vec3 b = glm::cross(n, t);
+	return d.x * t + d.y * b + sqrt(std::max(0.0f, 1 - glm::dot(d, d))) * n;
+}
+
+//  offset in [0, 1)² hashed from a point's coordinates.  Shifting a
+//  sample pattern by it decorrelates neighbouring shading points while
+//  keeping tiles identical wherever they are rendered.
+//
+inline glm::vec2 pointShift(const glm::vec3& p) {
+	uint32_t bits[3];
+	memcpy(bits, &p.x, sizeof(bits));
+	uint32_t hash = 2166136261u;
+	for (uint32_t b : bits) hash = (hash ^ b) * 16777619u;
+	hash ^= hash >> 15;
+	hash *= 2246822519u;
+	return glm::vec2((hash & 0xffff) / 65536.0f, (hash >> 16) / 65536.0f);
+}
+
+//  equirectangular mapping (environment maps, baked occlusion on spheres):
+//  u follows the angle around y (u = .5 looking down -z), v the angle
+//  from straight up
+//
+inline glm::vec2 directionToLatLong(const glm::vec3& d) {
+	return glm::vec2(atan2(d.x, -d.z) / (2 * PI) + .5f, acos(glm::clamp(d.y, -1.0f, 1.0f)) / PI);
+}
+inline glm::vec3 latLongToDirection(const glm::vec2& uv) {
+	float theta = PI * uv.y, phi = 2 * PI * (uv.x - .5f);
+	return glm::vec3(sin(theta) * sin(phi), cos(theta), -sin(theta) * cos(phi));
+}
+
+//  Running mean of one pixel's samples, plus the variance of their
+//  luminance (Welford), for adaptive sampling
+//
+struct PixelStats {
+	glm::vec3 mean = glm::vec3(0);
+	float lumMean = 0, lumM2 = 0;
+	int n = 0;
+
+	void add(const glm::vec3& c) {
+		n++;
+		mean += (c - mean) / (float)n;
+		float lum = glm::dot(c, glm::vec3(.2126, .7152, .0722));
+		float delta = lum - lumMean;
+		lumMean += delta / n;
+		lumM2 += delta * (lum - lumMean);
+	}
+	// standard error of the mean luminance
+	float error() const { return (n < 2) ? FLT_MAX : sqrt(lumM2 / (n - 1) / n); }
+	bool converged(float threshold) const { return n >= minSamples && error() <= threshold; }
+
+	static const int minSamples = 4;  // never trust the variance of fewer
+};
+
+//  Receives finished tiles as they are rendered, as float RGB (3 floats
+//  per pixel, tile rows top to bottom).  writeTile() may be called from
+//  several threads at once, but never twice for the same pixels.
+//
+class TileSink {
+public:
+	virtual ~TileSink() {}
+	virtual bool begin(int width, int height) { return true; }
+	virtual void writeTile(const RenderTile& tile, const float* rgb) = 0;
+	virtual bool end() { return true; }
+};
+
+//  quantizes tiles into 8 bit pixels.  With a maximum size the pixels are
+//  a point sampled preview, so huge renders never need a full image.
+//
+class PixelsSink : public TileSink {
+public:
+	PixelsSink(ofPixels& p, int maxWidth = 0, int maxHeight = 0) : pixels(p) { this->maxWidth = maxWidth; this->maxHeight = maxHeight; }
+	bool begin(int width, int height);
+	void writeTile(const RenderTile& tile, const float* rgb);
+
+	ofPixels& pixels;
+	int maxWidth, maxHeight;
+	int scale = 1;
+};
+
+//  Streams an 8 bit PNG to disk one band of tiles at a time.  Only bands
+//  with tiles still in flight are held in memory.  Tiles have to come
+//  from makeTiles() (one band per row of tiles).
+//
+class PngWriter : public TileSink {
+public:
+	PngWriter(const string& path) { this->path = path; }
+	bool begin(int width, int height);
+	void writeTile(const RenderTile& tile, const float* rgb);
+	bool end();
+
+	struct Band {
+		vector<unsigned char> data;
+		size_t pixels = 0;
+		int rows = 0;
+	};
+
+	void writeChunk(const char* type, const vector<unsigned char>& data);
+
+	string path;
+	ofstream file;
+	mutex lock;
+	map<int, Band> bands;       // keyed by first row
+	int width = 0, height = 0;
+	int nextRow = 0;
+	uint32_t adlerA = 1, adlerB = 0;
+	bool ok = false;
+};
+
+//  Streams tiles straight into a PFM (portable float map) file as they
+//  finish, so HDR output never needs the whole image in memory.  The file
+//  is sized up front and each tile row is written at its final offset.
+//
+class PfmWriter : public TileSink {
+public:
+	PfmWriter(const string& path) { this->path = path; }
+	bool begin(int width, int height);
+	void writeTile(const RenderTile& tile, const float* rgb);
+	bool end();
+
+	string path;
+	fstream file;
+	mutex lock;
+	streamoff dataStart = 0;
+	int width = 0, height = 0;
+	bool ok = false;
+};
+
+//  Finished renders on disk, keyed by a hash of the scene snapshot (scene,
+//  lights, camera and settings).  Each entry keeps the snapshot it came
+//  from, so a hash collision can never hand back the wrong image.
+//
+class RenderCache {
+public:
+	RenderCache(const string& dir) { this->dir = dir; }
+	static string hash(const string& snapshot);
+	bool has(const string& snapshot, const string& ext) const;
+	bool fetch(const string& snapshot, const string& ext, const string& destination) const;
+	void store(const string& snapshot, const string& ext, const string& source) const;
+	string entry(const string& snapshot, const string& ext) const;
+	void prune(const string& keep) const;
+
+	string dir;                 // relative to the data folder
+	uint64_t maxBytes = 1ull << 30;  // least recently used entries go beyond this
+};
+
+//  sends every tile on to several sinks (null entries are skipped)
+//
+class TeeSink : public TileSink {
+public:
+	TeeSink(initializer_list<TileSink*> list) { for (TileSink* s : list) if (s) sinks.push_back(s); }
+	bool begin(int width, int height) {
+		for (TileSink* s : sinks) if (!s->begin(width, height)) return false;
+		return true;
+	}
+	void writeTile(const RenderTile& tile, const float* rgb) { for (TileSink* s : sinks) s->writeTile(tile, rgb); }
+	bool end() {
+		bool ok = true;
+		for (TileSink* s : sinks) ok = s->end() && ok;
+		return ok;
+	}
+
+	vector<TileSink*> sinks;
+};
+
+//  Minimal blocking TCP connection, used to farm tiles out to render
+//  workers.  Messages are length prefixed; pixel data is sent raw.
+//
+class TcpSocket {
+public:
+	TcpSocket() {}
+	~TcpSocket() { close(); }
+	TcpSocket(const TcpSocket&) = delete;
+	TcpSocket& operator=(const TcpSocket&) = delete;
+
+	bool connect(const string& host, int port, int timeoutMs);
+	bool listen(int port);
+	bool accept(TcpSocket& client);
+	void setTimeout(int ms);
+	void close();
+	bool isOpen() const { return fd != -1; }
+
+	bool sendAll(const void* data, size_t size);
+	bool recvAll(void* data, size_t size);
+	bool sendMessage(const string& msg);
+	bool recvMessage(string& msg);
+
+	intptr_t fd = -1;
 };
 
 //  Base class for any renderable object in the scene
@@ -48,6 +1001,7 @@ public:
 class SceneObject {
 public:
 	virtual void draw() = 0;    // pure virtual funcs - must be overloaded
+	virtual void addPrims(ScenePrims& prims, int index) { }    // flatten into the tracer's arrays
 	virtual bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal) { cout << "SceneObject::intersect" << endl; return false; }
 	virtual glm::vec3 getNormal(const glm::vec3& p) { return glm::vec3(0); }
 	virtual glm::vec3 getIntersectionPoint() { return glm::vec3(1); }
@@ -55,6 +1009,7 @@ public:
 
 	// any data common to all scene objects goes here
 	glm::vec3 position = glm::vec3(0, 0, 0);
+	glm::vec3 motion = glm::vec3(0, 0, 0);     // offset over one frame (motion blur)
 	glm::vec3 intersectionPoint;
 
 	// material properties (we will ultimately replace this with a Material class - TBD)
@@ -78,6 +1033,9 @@ public:
 	void draw() {
 		ofDrawSphere(position, radius);
 	}
+	void addPrims(ScenePrims& prims, int index) {
+		prims.spheres.push_back(SpherePrim{ position, radius, index, motion });
+	}
 	void setNormal(const glm::vec3& p) { normal = p; }
 
 	glm::vec3 getNormal(const glm::vec3& p) { return glm::normalize(normal); }
@@ -102,18 +1060,37 @@ public:
 	void setIntensity(float i) {
 		intensity = i;
 	}
+	void setRange(float r) {
+		range = r;
+	}
+	void addPrims(ScenePrims& prims, int index) {
+		prims.lights.push_back(PointLightPrim{ position, intensity, motion, invRange2(range) });
+	}
 	float radius = 1.5;
 	float intensity = 0.0;
+	float range = 0;            // distance the light reaches, 0 = unlimited
 };
 
+//  Spot lights stay alive between edits - change them through the
+//  setters, which keep the cached cone (direction, cosine, drawing
+//  transform) in sync.  Nothing is recomputed per frame or per ray.
+//
 class spotLight : public Light {
 public:
 	spotLight(glm::vec3 p, glm::vec3 aimPos, float i, float angle) {
-		position = p; intensity = i; aimPoint = aimPos; direction = p - aimPoint;
-		angle1 = angle;
-		coneAngle = tan(glm::radians(angle)) * coneHeight;
+		position = p; intensity = i; aimPoint = aimPos; this->angle = angle;
+		update();
+	}
+	spotLight() { update(); }
+
+	void setPosition(const glm::vec3& p) { position = p; update(); }
+	void setAimPoint(const glm::vec3& p) { aimPoint = p; update(); }
+	void setAngle(float degrees) { angle = degrees; update(); }
+	float getAngle() const { return angle; }
+
+	void addPrims(ScenePrims& prims, int index) {
+		prims.spotLights.push_back(SpotLightPrim{ position, direction, intensity, cosAngle, motion, invRange2(range) });
 	}
-	spotLight() {}
 
 
 	void draw() {
@@ -124,12 +1101,11 @@ public:
 
 
 
-		// draw a cone object oriented towards aim position using the lookAt transformation
-	// matrix.  The "up" vector is (0, 1, 0)
+		// draw a cone object oriented towards aim position (orientation is the
+		// inverse lookAt transformation, "up" vector is (0, 1, 0))
 	//
 		ofPushMatrix();
-		glm::mat4 m = glm::lookAt(position, aimPoint, glm::vec3(0, 1, 0));
-		ofMultMatrix(glm::inverse(m));
+		ofMultMatrix(orientation);
 		ofRotate(-90, 1, 0, 0);
 		ofSetColor(ofColor::lightGray);
 		ofDrawCone(coneAngle, coneHeight);
@@ -138,16 +1114,25 @@ public:
 
 	}
 
-	glm::vec3 direction = glm::vec3(0);
-	glm::vec3 aimPoint = glm::vec3(0);
+	glm::vec3 aimPoint = glm::vec3(0, -1, 0);
+
+	// derived from position, aimPoint and angle by update()
+	glm::vec3 direction;        // unit vector from the light towards the aim point
+	float cosAngle;             // cosine of the cone half angle
+	float coneAngle;            // cone radius at coneHeight (drawn cone and aim handle size)
+	glm::mat4 orientation;
 
-	float coneAngle = 0;
-	float length = 20;
 	float coneHeight = 50;
-	bool lightSelected = false;
-	bool aimPointSelected = false;
 
-	float angle1 = 15;
+private:
+	void update() {
+		direction = glm::normalize(aimPoint - position);
+		cosAngle = cos(glm::radians(angle));
+		coneAngle = tan(glm::radians(angle)) * coneHeight;
+		orientation = glm::inverse(glm::lookAt(position, aimPoint, glm::vec3(0, 1, 0)));
+	}
+
+	float angle = 15;           // cone half angle in degrees
 };
 
 
@@ -179,6 +1164,9 @@ public:
 	bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal);
 	float sdf(const glm::vec3& p);
 	glm::vec3 getNormal(const glm::vec3& p) { return this->normal; }
+	void addPrims(ScenePrims& prims, int index) {
+		prims.planes.push_back(PlanePrim{ position, normal, width, height, index, motion });
+	}
 	glm::vec3 getIntersectionPoint() { return this->intersectionPoint; }
 	void setIntersectionPoint(const glm::vec3& p) { intersectionPoint = p; }
 	void draw() {
@@ -210,17 +1198,17 @@ public:
 	}
 
 	void setSize(glm::vec2 min, glm::vec2 max) { this->min = min; this->max = max; }
-	float getAspect() { return width() / height(); }
+	float getAspect() const { return width() / height(); }
 
-	glm::vec3 toWorld(float u, float v);   //   (u, v) --> (x, y, z) [ world space ]
+	glm::vec3 toWorld(float u, float v) const;   //   (u, v) --> (x, y, z) [ world space ]
 
 	void draw() {
 		ofDrawRectangle(glm::vec3(min.x, min.y, position.z), width(), height());
 	}
-	float width() {
+	float width() const {
 		return (max.x - min.x);
 	}
-	float height() {
+	float height() const {
 		return (max.y - min.y);
 	}
 
@@ -251,16 +1239,89 @@ public:
 		position = glm::vec3(0, 0, 25);
 		aim = glm::vec3(0, 0, -1);
 	}
-	Ray getRay(float u, float v);
+	Ray getRay(float u, float v, const glm::vec2& lens = glm::vec2(0)) const;
+	void setFov(float fov, float aspect);
 	void draw() { ofDrawBox(position, 1.0); };
 	void drawFrustum();
 
 	glm::vec3 aim;
 	ViewPlane view;          // The camera viewplane, this is the view that we will render 
+
+	// thin lens - with an aperture, rays leave from a point on the lens and
+	// converge on the plane focusDistance in front of the camera
+	float aperture = 0;      // lens radius, 0 is a pinhole
+	float focusDistance = 25;
 };
 
 
 
+//  Camera view volume as six inward facing planes, for culling the
+//  editor viewport against the same bounds the tracer uses
+//
+struct Frustum {
+	Frustum(const glm::mat4& viewProjection);
+	bool visible(const Bounds& b) const;
+
+	glm::vec4 planes[6];        // xyz normal, w offset
+};
+
+//  Editor viewport drawing of the scene objects: one instanced draw per
+//  primitive type and detail level, with each object's transform and
+//  color as per instance attributes, instead of a draw call and color
+//  change per object.  Spheres outside the view are culled every frame
+//  and distant ones drop to a coarser mesh, then to a bounding box.
+//  Planes are few and scene sized, so they are always drawn.  Shading
+//  follows ofApp::shade() (minus shadows) for up to maxLights of each
+//  kind of light.  Needs a GL 3.3 context (see main.cpp).
+//
+class PreviewRenderer {
+public:
+	void setup();
+	void build(const ScenePrims& objects);    // after the scene changes
+	void setLighting(const ScenePrims& lighting, const glm::vec3& eye, float power, bool specular);
+	void draw(const ofCamera& cam);
+	void applyLighting(const ofShader& shader) const;
+
+	// sphere detail levels, picked by projected radius in pixels
+	enum { Full, Coarse, Box, LodCount };
+	struct Lod {
+		ofVboMesh mesh;
+		ofBufferObject instances;
+		int count = 0;
+	};
+	Lod sphereLods[LodCount];
+	float fullDetailPixels = 40;             // below this use the coarse mesh
+	float boxPixels = 6;                     // below this just the bounding box
+
+	ofShader sphereShader, planeShader;
+	ofVboMesh planeMesh;                     // unit quad in xy
+	ofBufferObject planeInstances;
+	int planeCount = 0;
+
+	vector<SpherePrim> spheres;
+	vector<glm::vec4> sphereColors;          // indexed like spheres
+	vector<glm::vec4> lodData[LodCount];     // per frame instance data, kept to avoid reallocating
+
+	// shader uniforms, see previewFrag
+	static const size_t maxLights = 8;
+	vector<glm::vec4> lights, spotLights, spotDirs;
+	vector<float> lightInvRange2, spotInvRange2;
+	glm::vec3 eye;
+	float power = 100;
+	bool specular = true;
+
+	// per instance attribute locations (after oF's position/color/normal/texcoord)
+	static const int instanceA = 4, instanceB = 5, instanceColor = 6;
+};
+
+//  What a mouse click landed on
+//
+struct PickHandle {
+	enum Kind { None, Object, Light, AimPoint };
+	Kind kind = None;
+	int index = -1;             // into ofApp::scene for objects, ofApp::spotLights for lights
+};
+
 class ofApp : public ofBaseApp {
 
 public:
@@ -282,14 +1343,80 @@ public:
 	void rayTrace();
 	void drawGrid();
 	void drawAxis(glm::vec3 position);
-	ofColor ambient(ofColor diffuse);
-	ofColor lambert(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, float distance, Ray r, Light light);
-	ofColor phong(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, const ofColor specular, float power, float distance, Ray r, Light light);
-	ofColor shade(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, float distance, const ofColor specular, float power, Ray r);
-	ofColor spotLightLambert(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, float distance, Ray r, spotLight light);
-	ofColor spotLightLambert2(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, float distance, Ray r, spotLight light);
+	template<bool Shadows>
+	glm::vec3 ambient(const glm::vec3& p, const glm::vec3& norm, const glm::vec3& diffuse, float time) const;
+	float occlusion(const glm::vec3& p, const glm::vec3& norm, int object, float time) const;
+	void bakeOcclusion();
+	glm::vec3 indirect(const glm::vec3& p, const glm::vec3& norm, float time) const;
+	IrradianceCache::Record irradianceRecord(const glm::vec3& p, const glm::vec3& norm, float time) const;
+	void cacheIrradiance();
+	string irradianceKey() const;
+	glm::vec3 lambert(const glm::vec3& norm, const glm::vec3& diffuse, const glm::vec3& l, float irradiance) const;
+	glm::vec3 phong(const glm::vec3& p, const glm::vec3& norm, const glm::vec3& diffuse, const glm::vec3& specular, float power, const glm::vec3& l, float irradiance) const;
+	glm::vec3 spotLightLambert(const glm::vec3& p, const glm::vec3& norm, const glm::vec3& diffuse, const SpotLightPrim& light) const;
+
+	//  shading kernel, specialized on the features a render uses.  LightBucket
+	//  is 0 (no point lights), 1 (exactly one) or 2 (any number), Ambient
+	//  an AmbientMode.
+	//
+	enum AmbientMode { AmbientNone, AmbientEnvironment, AmbientOcclusion, AmbientIrradiance };
+	template<bool Shadows, bool SpotLights, bool Specular, int LightBucket, int Ambient>
+	glm::vec3 shade(const glm::vec3& p, const glm::vec3& norm, const glm::vec3& diffuse, const glm::vec3& specular, float time, int object) const;
+	template<bool Shadows, bool Specular>
+	glm::vec3 shadePointLight(const PointLightPrim& light, const glm::vec3& p, const glm::vec3& norm, const glm::vec3& diffuse, const glm::vec3& specular, float time) const;
+	typedef glm::vec3(ofApp::*ShadeFn)(const glm::vec3&, const glm::vec3&, const glm::vec3&, const glm::vec3&, float, int) const;
+	AmbientMode ambientMode() const;
+	ShadeFn selectShade() const;
+	ShadeFn selectBounce() const;
+	void captureSettings();
+	void applyPreset(const RenderPreset& preset);
+	bool applyPreset(const string& name);
+	RenderEstimate estimateRender();
+	void printEstimate();
 
 	void updateAngle(bool increase);
+	void setupScene();
+	void loadScene();
+	void updateScene();
+	void buildPrims();
+	void buildPickPrims();
+	PickHandle pick(const Ray& ray) const;
+
+	//  rendering - everything below reads only settings, density,
+	//  renderCam and prims, so it runs the same in the editor, headless
+	//  and in workers
+	//
+	void updateView();
+	void updateDensity();
+	bool render(TileSink& sink);
+	bool renderToFile(const string& path);
+	void renderTiles(const vector<RenderTile>& tiles, TileSink& sink) const;
+	void renderTile(const RenderTile& tile, float* rgb) const { renderTile(tile, rgb, 0, settings.samples); }
+	void renderTile(const RenderTile& tile, float* rgb, int firstSample, int samples) const;
+	void renderTileCoarse(const RenderTile& tile, float* rgb, int block) const;
+	glm::vec3 traceSample(int x, int y, int sample) const;
+	glm::vec3 traceRay(const Ray& r) const;
+	string saveSnapshot() const;
+	bool loadSnapshot(const string& snapshot);
+
+	//  time budgeted rendering - progressive passes until renderBudget
+	//  milliseconds are spent, counted from the start of render() so the
+	//  occlusion bake and irradiance cache come out of the budget.  Always
+	//  local and single process, and it keeps the whole image in floats,
+	//  so only up to maxStagedPixels
+	//
+	void renderBudgeted(const vector<RenderTile>& tiles, TileSink& sink, uint64_t deadline) const;
+
+	//  distributed rendering - tiles are handed out to worker processes
+	//  (started with --worker <port>) over TCP
+	//
+	void renderDistributed(const vector<RenderTile>& tiles, TileSink& sink);
+	int runWorker(int port);
+
+	//  multi-process rendering - forked children share one mmap'ed
+	//  framebuffer, each keeps its own copy-on-write snapshot of the scene
+	//
+	void renderForked(const vector<RenderTile>& tiles, TileSink& sink);
 
 	glm::vec3 planeNormal;
 	Plane p;
@@ -312,24 +1439,54 @@ public:
 	RenderCam renderCam;
 	ofImage image;
 
-	//object vectors
+	//object vectors (objects are owned by sceneArena, rebuilt by loadScene())
 	//
+	Arena sceneArena;
+	bool sceneDirty = true;
 	vector<SceneObject*> scene;
+	struct ExtraSphere {
+		glm::vec3 center;
+		float radius;
+		glm::vec3 motion;
+	};
+	vector<ExtraSphere> extraSpheres;    // from --sphere, added by loadScene()
+	ScenePrims prims;        // flattened copy of scene and lights used by rayTrace()
+	RenderSettings settings;
+	SampleDensity density;               // where samples go, uniform when empty (see updateDensity())
+	string densityMask;                  // image the density is loaded from, if not foveated
+	bool foveate = false;                // samples concentrate around foveaFocus
+	glm::vec2 foveaFocus = glm::vec2(.5); // 0-1 across and down the image
+	float foveaSize = .2;                // fovea radius as a fraction of the image height
+	bool foveaOnMouse = true;            // editor renders put the fovea where the mouse is, off after --fovea
+	EnvironmentMap environment;          // lights the scene and fills the background, none when empty
+	AoCache aoCache;                     // kept between renders, see bakeOcclusion()
+	IrradianceCache irradianceCache;     // rebuilt when the snapshot changes, see cacheIrradiance()
+	ShadeFn shadeFn = nullptr;
+	ShadeFn bounceFn = nullptr;          // shades what indirect rays hit
+	vector<string> renderWorkers;        // host:port of each worker, empty renders locally
+	int tileRetries = 3;
+	int renderProcesses = 1;             // > 1 forks that many render processes
+	int renderBudget = 0;                // ms, > 0 renders the best image that fits (not cached)
+	int budgetMaxSamples = 256;          // budgeted renders stop refining here
+	size_t maxStagedPixels = 4096 * 4096; // larger renders stream to disk and keep only a preview
+	RenderCache renderCache = RenderCache("renderCache");
+	bool useCache = true;
+	ScenePrims editPrims;                // scene objects only, rebuilt by loadScene() for the editor
+	PreviewRenderer preview;
+	bool previewDirty = true;
+	vector<SpherePrim> pickPrims;        // selectable spheres, object indexes pickHandles
+	vector<SpherePrim> handlePrims;      // light and aim handles, tested before pickPrims
+	vector<PickHandle> pickHandles;
+	Bvh<SpherePrim> pickBvh;
 	vector<Light*> light;
 	vector<spotLight*> spotLights;
-	int lightIndex;
-
-	vector<glm::vec3> aimPoint;
-	vector<glm::vec3> spotLightPos;
-	vector<float> angle;
+	int lightIndex = 0;                  // selected spot light
 	glm::vec3 mouseLast;
 
 
 	int imageWidth = 1200;
 	int imageHeight = 800;
 
-	int closestIndex = 0;
-
 	float slowdown = 1;
 
 
@@ -337,8 +1494,6 @@ public:
 	//
 	bool drawImage = false;
 	bool trace = false;
-	bool background = true;
-	bool blocked = false;
 	bool aimPointDrag = false;
 	bool lightDrag = false;
 	bool renderdraw = false;
@@ -348,6 +1503,31 @@ public:
 	ofxFloatSlider power;
 	ofxFloatSlider intensity;
 	ofxFloatSlider spotLightIntensity;
+	ofxFloatSlider lightRange;
+	ofxIntSlider renderWidth;
+	ofxIntSlider renderHeight;
+	ofxFloatSlider fov;
+	ofxFloatSlider aperture;
+	ofxFloatSlider focusDistance;
+	ofxToggle shadows;
+	ofxToggle specular;
+	ofxIntSlider processes;
+	ofxIntSlider pixelSamples;
+	ofxFloatSlider adaptiveThreshold;
+	ofxFloatSlider shutter;
+	ofxFloatSlider environmentIntensity;
+	ofxIntSlider environmentSamples;
+	ofxIntSlider aoSamples;
+	ofxFloatSlider aoDistance;
+	ofxFloatSlider aoIntensity;
+	ofxToggle aoBake;
+	ofxIntSlider irradianceSamples;
+	ofxFloatSlider irradianceError;
+	ofxToggle foveated;
+	ofxFloatSlider foveaRadius;
+	ofxIntSlider timeBudget;
+	ofxToggle saveHdr;
+	ofxToggle cacheRenders;
 
 	ofxPanel gui;
 